@@ -36,11 +36,20 @@
 #include "mqtt_client.h"
 #include "driver/gpio.h"
 #include "esp_ota_ops.h"
+#include "esp_timer.h"
 
 #define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 #include "esp_log.h"
 
 #include "x509helper.h"
+#include "level.h"
+#include "gpio_stats.h"
+#include "publisher.h"
+#include "latency.h"
+#include "brokers.h"
+#include "reconnect.h"
+#include "params.h"
+#include "trace.h"
 #include "common.h"
 
 static uint8_t basemac[6];
@@ -67,9 +76,41 @@ static const char* TAG_MQTT = "mqtt";
 static unsigned int client_crt_bytes;
 static unsigned int client_key_bytes;
 
+static esp_timer_handle_t wifi_retry_timer;
+
+static void wifi_retry_cb(void *arg) {
+    esp_wifi_connect();
+}
+
+/**
+ * Disconnect reasons, which involve the authentication (EAP-TLS via RADIUS).
+ * Retries are spread out more in that case, to take load off the RADIUS server.
+ */
+static bool is_auth_failure(uint8_t reason) {
+    switch (reason) {
+        case WIFI_REASON_AUTH_EXPIRE:
+        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_802_1X_AUTH_FAILED:
+        case WIFI_REASON_AUTH_FAIL:
+        case WIFI_REASON_HANDSHAKE_TIMEOUT:
+            return true;
+        default:
+            return false;
+    }
+}
+
 static void wifi_event_handler(void* arg, esp_event_base_t event_base, 
         int32_t event_id, void* event_data)
 {
+    if (event_base == WIFI_EVENT) {
+        int32_t reason = 0;
+        if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+            reason = ((system_event_sta_disconnected_t *)event_data)->reason;
+        }
+        trace(TRACE_WIFI, event_id, reason);
+    } else {
+        trace(TRACE_IP, event_id, ((ip_event_got_ip_t *)event_data)->ip_info.ip.addr);
+    }
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
@@ -78,11 +119,15 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
             // Switch to 802.11 bgn mode
             esp_wifi_set_protocol(ESP_IF_WIFI_STA, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N);
         }
-        esp_wifi_connect();
-        xEventGroupClearBits(appState, WIFI_CONNECTED);
-        xEventGroupClearBits(appState, NTP_SYNCED);
+        wifi_reconnect.lost(esp_timer_get_time());
+        uint32_t delay = wifi_reconnect.next_delay(is_auth_failure(event->reason) ? CONFIG_WIFI_BACKOFF_AUTH_BASE_MS : 0);
+        ESP_LOGD(TAG, "WiFi disconnected (reason %d), reconnecting in %u ms", event->reason, delay);
+        esp_timer_stop(wifi_retry_timer);
+        esp_timer_start_once(wifi_retry_timer, delay * 1000ULL);
+        trace_clear_bits(WIFI_CONNECTED | NTP_SYNCED);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        xEventGroupSetBits(appState, WIFI_CONNECTED);
+        wifi_reconnect.recovered(esp_timer_get_time());
+        trace_set_bits(WIFI_CONNECTED);
     }
 }
 
@@ -110,6 +155,14 @@ static void wifi_init(void)
     ESP_LOGI(TAG, "My MAC: " MACSTR, MAC2STR(basemac));
     ESP_LOGI(TAG, "My CN:  %s", identity.c_str());
 
+    reconnect_seed(basemac);
+    const esp_timer_create_args_t targs = {
+        .callback = &wifi_retry_cb,
+        .arg = nullptr,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&targs, &wifi_retry_timer));
+
     tcpip_adapter_init();
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
@@ -132,61 +185,240 @@ static void wifi_init(void)
 
 static xQueueHandle gpio_evt_queue = nullptr;
 
+// Events, queued by the ISR
+typedef struct {
+    gpio_num_t gpio;
+    int64_t isr_us; // esp_timer_get_time() in the ISR
+} gpio_evt_t;
+
 #define GPIO_INPUT GPIO_NUM_4 // GPIO4 aka D2 on NodeMCU or D1 mini
 
 static int last_level = -2;
+static GpioStats gpio_stats(GPIO_INPUT);
+
+/**
+ * Milliseconds since boot
+ */
+static inline uint32_t now_ms() {
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
 
 /**
  * Publish current state of GPIO pin to MQTT.
- * This is in a separate function, so that it can be
- * invoked at boot.
+ * Must only be called from gpio_task, which owns gpio_stats and last_level.
+ * Other tasks use request_gpio_publish().
+ * @param isr_us Timestamp of the interrupt or 0, if not invoked because of an interrupt.
+ *        If per-edge publishing is disabled, only the statistics are updated on interrupts.
  */
-static void publish_gpio(gpio_num_t gpio) {
+static void publish_gpio(gpio_num_t gpio, int64_t isr_us) {
+    int64_t start_us = esp_timer_get_time();
     int lvl = gpio_get_level(gpio);
-    if (last_level != lvl) {
-        vTaskDelay(10 / portTICK_PERIOD_MS); // debounce
+    if ((last_level != lvl) || (gpio_stats.level() != lvl)) {
+        vTaskDelay(param_get(PARAM_DEBOUNCE_MS) / portTICK_PERIOD_MS); // debounce
         if (lvl == gpio_get_level(gpio)) {
-            last_level = lvl;
-            char topic[50];
-            snprintf(topic, sizeof(topic), "esp8266/gpio%d/%d", gpio, gpio_get_level(gpio));
-            esp_mqtt_client_publish(client, topic, identity.c_str(), 0, 0, 0);
+            if (isr_us) {
+                latency_record(LAT_DEBOUNCE, esp_timer_get_time() - start_us);
+            }
+            if (gpio_stats.level() != lvl) {
+                char name[10];
+                snprintf(name, sizeof(name), "gpio%d", gpio);
+                publish_state(name, lvl ? "1" : "0");
+            }
+            gpio_stats.update(lvl, now_ms());
+            if ((last_level != lvl) && (xEventGroupGetBits(appState) & MQTT_CONNECTED)) {
+                if (isr_us && !param_get(PARAM_PUBLISH_EDGES)) {
+                    return;
+                }
+                last_level = lvl;
+                char topic[50];
+                snprintf(topic, sizeof(topic), "esp8266/gpio%d/%d", gpio, lvl);
+                publish(PUB_EVENT, topic, identity.c_str(), isr_us);
+            }
         }
     }
 }
 
+/**
+ * Publish JSON formatted by one of the *_stats() functions to
+ * CONFIG_MQTT_TELEMETRY_PREFIX/<CN>/<name>, unless it has been truncated.
+ * @param len Return value of the formatting function.
+ */
+static void publish_json(const char *name, const char *buf, int len, size_t size) {
+    if ((0 > len) || ((size_t)len >= size)) {
+        ESP_LOGW(TAG, "%s: buffer too small (%d bytes needed)", name, len + 1);
+        return;
+    }
+    publish(PUB_TELEMETRY, (CONFIG_MQTT_TELEMETRY_PREFIX "/" + identity + "/" + name).c_str(), buf);
+}
+
+/**
+ * Publish statistics of the GPIO pin to MQTT and start a new interval.
+ */
+static void publish_gpio_summary(gpio_num_t gpio) {
+    char name[20];
+    // About 150 bytes, the id (up to 64 bytes) and up to 10 digits per number
+    char buf[350];
+    snprintf(name, sizeof(name), "gpio%d/summary", gpio);
+    int len = gpio_stats.summary(now_ms(), identity.c_str(), buf, sizeof(buf));
+    publish_json(name, buf, len, sizeof(buf));
+}
+
+#if CONFIG_LEVEL_ADC_ENABLE
+/**
+ * Publish filtered analog level to MQTT.
+ * Invoked from the level task, if the level has left the deadband.
+ */
+static void publish_level(int level, int state, bool state_changed) {
+    char value[10];
+    snprintf(value, sizeof(value), "%d", level);
+    publish_state("adc", value);
+    if (0 == (xEventGroupGetBits(appState) & MQTT_CONNECTED)) {
+        return;
+    }
+    char topic[50];
+    snprintf(topic, sizeof(topic), "esp8266/adc/%d", level);
+    publish(PUB_EVENT, topic, identity.c_str());
+    if (state_changed) {
+        snprintf(topic, sizeof(topic), "esp8266/adcstate/%d", state);
+        publish(PUB_EVENT, topic, identity.c_str());
+    }
+}
+#endif
+
 /**
  * Publish current version to MQTT.
  */
 static void publish_version() {
     char topic[50];
     snprintf(topic, sizeof(topic), "esp8266/version/%s", ad->version);
-    esp_mqtt_client_publish(client, topic, identity.c_str(), 0, 0, 0);
+    publish(PUB_INFO, topic, identity.c_str());
+    publish_state("version", ad->version);
+}
+
+/**
+ * Publish latency histograms to MQTT.
+ * @param reset If true, start new histograms afterwards.
+ */
+static void publish_latency(bool reset) {
+    // The id and bounds, about 50 bytes plus up to 11 bytes per bucket for each stage
+    char buf[200 + LAT_STAGE_MAX * (50 + LAT_NUM_BUCKETS * 11)];
+    int len = latency_stats(identity.c_str(), buf, sizeof(buf), reset);
+    publish_json("stats/latency", buf, len, sizeof(buf));
+}
+
+static esp_timer_handle_t latency_timer;
+
+static void latency_timer_cb(void *arg) {
+    if (xEventGroupGetBits(appState) & MQTT_CONNECTED) {
+        publish_latency(true);
+    }
+}
+
+/**
+ * (Re)start periodic publishing of the latency histograms.
+ * @param interval Interval in seconds, 0 disables periodic publishing.
+ */
+static void set_latency_interval(int32_t interval) {
+    esp_timer_stop(latency_timer);
+    if (0 < interval) {
+        ESP_ERROR_CHECK(esp_timer_start_periodic(latency_timer, interval * 1000000ULL));
+    }
+}
+
+static void init_latency_report(void) {
+    const esp_timer_create_args_t targs = {
+        .callback = &latency_timer_cb,
+        .arg = nullptr,
+        .name = "latency_report",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&targs, &latency_timer));
+    set_latency_interval(param_get(PARAM_LATENCY_INTERVAL));
+    param_on_change(PARAM_LATENCY_INTERVAL, &set_latency_interval);
+}
+
+/**
+ * Publish WiFi/MQTT reconnect statistics to MQTT.
+ */
+static void publish_recovery() {
+    // About 90 bytes and the id, plus about 140 bytes each for WiFi and MQTT
+    char buf[400];
+    int len = reconnect_stats(identity.c_str(), buf, sizeof(buf));
+    publish_json("stats/recovery", buf, len, sizeof(buf));
+}
+
+static void publish_broker_stats() {
+    // About 130 bytes plus about 85 bytes and the URI per broker
+    char buf[200 + MAX_BROKERS * 200];
+    int len = brokers_stats(identity.c_str(), buf, sizeof(buf));
+    publish_json("stats/brokers", buf, len, sizeof(buf));
+}
+
+/**
+ * Publish statistics to MQTT.
+ */
+static void publish_stats() {
+    char buf[500];
+    int len = publisher_stats(identity.c_str(), buf, sizeof(buf));
+    publish_json("stats/publish", buf, len, sizeof(buf));
+    publish_broker_stats();
+    publish_recovery();
+    publish_latency(false);
 }
 
 /**
  * GPIO task
- * Publishes changes queued by the ISR to MQTT.
+ * Updates statistics and publishes changes queued by the ISR to MQTT.
+ * If enabled, publishes a summary every summary_s seconds.
+ * Events with isr_us == 0 are requests from other tasks (e.g. after connecting
+ * or after summary_s has changed) to publish the current level.
  */
 static void gpio_task(void * pvParameter) {
-    gpio_num_t gpio;
+    gpio_evt_t evt;
+    TickType_t last_summary = xTaskGetTickCount();
+    publish_gpio(GPIO_INPUT, 0);
     while (true) {
-        if (xQueueReceive(gpio_evt_queue, &gpio, portMAX_DELAY)) {
-            ESP_LOGD(TAG, "GPIO[%d] intr", gpio);
-            publish_gpio(gpio);
+        TickType_t wait = portMAX_DELAY;
+        TickType_t interval = param_get(PARAM_SUMMARY_INTERVAL) * 1000 / portTICK_PERIOD_MS;
+        if (0 < interval) {
+            int32_t remaining = (int32_t)(last_summary + interval - xTaskGetTickCount());
+            wait = (0 < remaining) ? remaining : 0;
+        }
+        if (xQueueReceive(gpio_evt_queue, &evt, wait)) {
+            if (evt.isr_us) {
+                ESP_LOGD(TAG, "GPIO[%d] intr", evt.gpio);
+                latency_record(LAT_ISR_QUEUE, esp_timer_get_time() - evt.isr_us);
+            }
+            publish_gpio(evt.gpio, evt.isr_us);
+        }
+        if ((0 < interval) && (0 >= (int32_t)(last_summary + interval - xTaskGetTickCount()))) {
+            last_summary = xTaskGetTickCount();
+            publish_gpio_summary(GPIO_INPUT);
         }
     }
 }
 
+/**
+ * Ask gpio_task to publish the current level (and re-evaluate the summary interval).
+ */
+static void request_gpio_publish() {
+    if (nullptr != gpio_evt_queue) {
+        gpio_evt_t evt = { GPIO_INPUT, 0 };
+        xQueueSend(gpio_evt_queue, &evt, 0);
+    }
+}
+
+static void summary_interval_changed(int32_t interval) {
+    request_gpio_publish();
+}
+
 /**
  * The gpio ISR
  * Just enqueues an event.
  */
 static void gpio_isr(void *arg) {
-    // enqueue events only if we are connected to MQTT
-    if (xEventGroupWaitBits(appState, MQTT_CONNECTED, pdFALSE, pdFALSE, 0) & MQTT_CONNECTED) {
-        uint32_t gpio_num = (uint32_t) arg;
-        xQueueSendFromISR(gpio_evt_queue, &gpio_num, nullptr);
-    }
+    gpio_evt_t evt = { (gpio_num_t)(uint32_t) arg, esp_timer_get_time() };
+    trace_isr(TRACE_GPIO, evt.gpio, gpio_get_level(evt.gpio));
+    xQueueSendFromISR(gpio_evt_queue, &evt, nullptr);
 }
 
 /**
@@ -198,12 +430,13 @@ static void init_gpio(void) {
         .mode = GPIO_MODE_INPUT,
         .pull_up_en = GPIO_PULLUP_ENABLE,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_NEGEDGE,
+        .intr_type = GPIO_INTR_ANYEDGE,
     };
     gpio_config(&io_conf);
-    gpio_evt_queue = xQueueCreate(10, sizeof(uint32_t));
+    gpio_evt_queue = xQueueCreate(param_get(PARAM_GPIO_QUEUE_LEN), sizeof(gpio_evt_t));
 
-    xTaskCreate(&gpio_task, "gpio_task", 2048, nullptr, 10, nullptr);
+    xTaskCreate(&gpio_task, "gpio_task", param_get(PARAM_GPIO_STACK), nullptr, 10, nullptr);
+    param_on_change(PARAM_SUMMARY_INTERVAL, &summary_interval_changed);
 
     // install gpio isr service
     gpio_install_isr_service(0);
@@ -219,6 +452,11 @@ static void enable_debug(bool enable) {
         esp_log_level_set("mqtt", ESP_LOG_DEBUG);
         esp_log_level_set("heap", ESP_LOG_DEBUG);
         esp_log_level_set("HTTP_CLIENT", ESP_LOG_DEBUG);
+        esp_log_level_set("level", ESP_LOG_DEBUG);
+        esp_log_level_set("publisher", ESP_LOG_DEBUG);
+        esp_log_level_set("brokers", ESP_LOG_DEBUG);
+        esp_log_level_set("params", ESP_LOG_DEBUG);
+        esp_log_level_set("trace", ESP_LOG_DEBUG);
         //esp_log_level_set("syslog", ESP_LOG_DEBUG);
         ESP_LOGI(TAG, "debug enabled");
     } else {
@@ -228,10 +466,37 @@ static void enable_debug(bool enable) {
         esp_log_level_set("mqtt", ESP_LOG_INFO);
         esp_log_level_set("heap", ESP_LOG_INFO);
         esp_log_level_set("syslog", ESP_LOG_INFO);
+        esp_log_level_set("level", ESP_LOG_INFO);
+        esp_log_level_set("publisher", ESP_LOG_INFO);
+        esp_log_level_set("brokers", ESP_LOG_INFO);
+        esp_log_level_set("params", ESP_LOG_INFO);
+        esp_log_level_set("trace", ESP_LOG_INFO);
         ESP_LOGI(TAG, "debug disabled");
     }
 }
 
+/**
+ * Publish the value of a parameter to MQTT.
+ */
+static void publish_param(const std::string &name) {
+    char value[16];
+    if (ESP_OK == param_format(name.c_str(), value, sizeof(value))) {
+        char topic[80];
+        snprintf(topic, sizeof(topic), "esp8266/param/%s/%s", name.c_str(), value);
+        publish(PUB_INFO, topic, identity.c_str());
+    }
+}
+
+/**
+ * Publish all parameters (with bounds) as JSON to MQTT.
+ */
+static void publish_params() {
+    // The id, plus up to about 125 bytes per parameter
+    char buf[100 + PARAM_MAX * 125];
+    int len = params_json(identity.c_str(), buf, sizeof(buf));
+    publish_json("params", buf, len, sizeof(buf));
+}
+
 static void mqtt_action(const std::string &topic, const std::string &data) {
     bool match_exact = 0 == data.compare(identity);
     bool match_any = data.empty();
@@ -250,7 +515,7 @@ static void mqtt_action(const std::string &topic, const std::string &data) {
     }
     if (0 == topic.compare("esp8266/update")) {
         if (match_exact || match_any) {
-            xEventGroupSetBits(appState, OTA_REQUIRED);
+            trace_set_bits(OTA_REQUIRED);
         }
         return;
     }
@@ -258,6 +523,50 @@ static void mqtt_action(const std::string &topic, const std::string &data) {
         if (match_exact || match_any) {
             enable_debug(0 == topic.compare("esp8266/debug"));
         }
+        return;
+    }
+    if (0 == topic.compare("esp8266/stats")) {
+        if (match_exact || match_any) {
+            publish_stats();
+        }
+        return;
+    }
+    if (0 == topic.compare("esp8266/trace")) {
+        if (match_exact || match_any) {
+            trace_dump((CONFIG_TRACE_TOPIC_PREFIX "/" + identity).c_str());
+        }
+        return;
+    }
+    if (match_exact && (0 == topic.compare("esp8266/get"))) {
+        publish_params();
+        return;
+    }
+    if (match_exact && (0 == topic.compare(0, 12, "esp8266/get/"))) {
+        publish_param(topic.substr(12));
+        return;
+    }
+    if (match_exact && (0 == topic.compare(0, 12, "esp8266/set/"))) {
+        // esp8266/set/<name>/<value>
+        size_t sep = topic.find('/', 12);
+        if (std::string::npos != sep) {
+            std::string name = topic.substr(12, sep - 12);
+            int32_t value = 0;
+            int reboot = 0;
+            esp_err_t err = param_set(name.c_str(), topic.substr(sep + 1).c_str(), &value, &reboot);
+            if (ESP_OK != err) {
+                ESP_LOGW(TAG, "Unable to set %s: %s", name.c_str(), esp_err_to_name(err));
+                syslog(LOG_WARNING, "Unable to set %s: %s", name.c_str(), esp_err_to_name(err));
+                return;
+            }
+            if (reboot) {
+                // Takes effect after reboot, so report the new value
+                char ptopic[80];
+                snprintf(ptopic, sizeof(ptopic), "esp8266/param/%s/%d", name.c_str(), value);
+                publish(PUB_INFO, ptopic, identity.c_str());
+            } else {
+                publish_param(name);
+            }
+        }
     }
 }
 
@@ -266,7 +575,7 @@ static void mqtt_action(const std::string &topic, const std::string &data) {
  */
 static void ntp_sync_cb(struct timeval *tv) {
     if (SNTP_SYNC_STATUS_COMPLETED == sntp_get_sync_status()) {
-        xEventGroupSetBits(appState, NTP_SYNCED);
+        trace_set_bits(NTP_SYNCED);
         struct tm _tm;
         time_t now;
         time(&now);
@@ -276,7 +585,7 @@ static void ntp_sync_cb(struct timeval *tv) {
         ESP_LOGI(TAG, "Time synchronized to: %s", tbuf);
         syslog(LOG_DEBUG, "Time synchronized to: %s", tbuf);
     } else {
-        xEventGroupClearBits(appState, NTP_SYNCED);
+        trace_clear_bits(NTP_SYNCED);
     }
 }
 
@@ -296,20 +605,27 @@ static void check_ntpserver() {
 static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
     esp_mqtt_client_handle_t client = event->client;
     int msg_id;
+    trace(TRACE_MQTT, event->event_id, event->msg_id);
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED:
             ESP_LOGD(TAG_MQTT, "MQTT_EVENT_CONNECTED");
-            syslog(LOG_INFO, "Connected to broker %s", CONFIG_MQTTS_URI);
+            syslog(LOG_INFO, "Connected to broker %s", brokers_current_uri());
+            brokers_connected();
             msg_id = esp_mqtt_client_subscribe(client, "esp8266/#", 0);
             ESP_LOGD(TAG_MQTT, "sent subscribe successful, msg_id=%d", msg_id);
-            msg_id = esp_mqtt_client_publish(client, "esp8266/start", identity.c_str(), 0, 0, 0);
-            ESP_LOGD(TAG_MQTT, "sent publish successful, msg_id=%d", msg_id);
+            publisher_connected();
+            publish(PUB_INFO, "esp8266/start", identity.c_str());
             publish_version();
-            publish_gpio(GPIO_INPUT);
-            xEventGroupSetBits(appState, MQTT_CONNECTED);
+            trace_set_bits(MQTT_CONNECTED);
+            request_gpio_publish();
+#if CONFIG_LEVEL_ADC_ENABLE
+            level_report_now();
+#endif
             break;
         case MQTT_EVENT_DISCONNECTED:
-            xEventGroupClearBits(appState, MQTT_CONNECTED);
+            trace_clear_bits(MQTT_CONNECTED);
+            publisher_disconnected();
+            brokers_disconnected();
             ESP_LOGD(TAG_MQTT, "MQTT_EVENT_DISCONNECTED");
             break;
         case MQTT_EVENT_SUBSCRIBED:
@@ -320,6 +636,7 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
             break;
         case MQTT_EVENT_PUBLISHED:
             ESP_LOGD(TAG_MQTT, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            publisher_published(event->msg_id);
             break;
         case MQTT_EVENT_DATA:
             ESP_LOGD(TAG_MQTT, "MQTT_EVENT_DATA");
@@ -336,6 +653,7 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
             break;
         case MQTT_EVENT_BEFORE_CONNECT:
             ESP_LOGD(TAG_MQTT, "MQTT_EVENT_BEFORE_CONNECT");
+            brokers_before_connect();
             break;
         default:
             ESP_LOGW(TAG, "Other event id:%d", event->event_id);
@@ -351,15 +669,19 @@ static void mqtt_init(void)
     snprintf(idbuf, sizeof(idbuf), "esp8266-%02x%02x%02x%02x%02x%02x", MAC2STR(basemac));
     const esp_mqtt_client_config_t mqtt_cfg = {
         .event_handle = mqtt_event_handler,
-        .uri = CONFIG_MQTTS_URI,
+        .uri = init_brokers(),
         .client_id = idbuf,
         .lwt_topic = "esp8266/dead",
         .lwt_msg = identity.c_str(),
+        .disable_auto_reconnect = true, // reconnects are scheduled by the broker task
         .cert_pem = (const char *)ca_crt_start,
         .client_cert_pem = (const char *)client_crt_start,
         .client_key_pem = (const char *)client_key_start,
     };
     client = esp_mqtt_client_init(&mqtt_cfg);
+    init_publisher(client, identity.c_str());
+    // Recovery stats are published by the broker task, which updates them
+    brokers_on_connected(&publish_recovery);
 }
 
 /**
@@ -371,20 +693,24 @@ static void update_check_task(void * pvParameter) {
         EventBits_t bits = xEventGroupWaitBits(appState, OTA_REQUIRED,
                 pdTRUE, pdFALSE, portMAX_DELAY);
         if (bits & OTA_REQUIRED) {
+            trace_consumed_bits(OTA_REQUIRED);
             ESP_LOGI(TAG, "Firmware update requested, shutting down MQTT");
             syslog(LOG_NOTICE, "Firmware update requested, shutting down MQTT");
             syslog_flush();
-            ESP_ERROR_CHECK(esp_mqtt_client_stop(client));
+            ESP_ERROR_CHECK(brokers_stop());
+            trace_clear_bits(MQTT_CONNECTED);
+            publisher_disconnected();
             sntp_stop();
             ESP_LOGD(TAG_MEM, "Free memory: %d bytes", esp_get_free_heap_size());
-            xTaskCreate(&ota_task, "ota_task", 9216, ca_crt_start, 5, nullptr);
+            xTaskCreate(&ota_task, "ota_task", param_get(PARAM_OTA_STACK), ca_crt_start, 5, nullptr);
             while (true) {
                 bits = xEventGroupWaitBits(appState, OTA_DONE, pdTRUE, pdFALSE, portMAX_DELAY);
                 if (bits & OTA_DONE) {
+                    trace_consumed_bits(OTA_DONE);
                     // If we arrive here, OTA has failed prematurely (e.g. 404 or somethin similar)
                     ESP_LOGD(TAG_MEM, "Free memory: %d bytes", esp_get_free_heap_size());
                     ESP_LOGI(TAG, "Restarting MQTT");
-                    ESP_ERROR_CHECK(esp_mqtt_client_start(client));
+                    ESP_ERROR_CHECK(brokers_start(client));
                     sntp_init();
                     break;
                 }
@@ -409,7 +735,9 @@ void app_main()
     ESP_LOGI(TAG, "APP build: %s %s", ad->date, ad->time);
     ESP_LOGI(TAG, "IDF version: %s", ad->idf_ver);
     appState = xEventGroupCreate();
+    init_trace();
     ESP_ERROR_CHECK(nvs_flash_init());
+    init_params();
     // Get rid of stupid "Base MAC address is not set ..." message by
     // explicitely setting base MAC addr from EFUSE.
     ESP_ERROR_CHECK(esp_efuse_mac_get_default(basemac));
@@ -427,7 +755,7 @@ void app_main()
     memset(&ip, 0, sizeof(tcpip_adapter_ip_info_t));
     while (true) {
         EventBits_t bits = xEventGroupWaitBits(appState, WIFI_CONNECTED,
-                pdFALSE, pdFALSE, 2000 / portTICK_PERIOD_MS);
+                pdFALSE, pdFALSE, param_get(PARAM_POLL_MS) / portTICK_PERIOD_MS);
         if (bits & WIFI_CONNECTED) {
             printf("\r\n"); // WiFi connected message does not have a linefeed
             if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ip) == 0) {
@@ -437,12 +765,16 @@ void app_main()
                 check_ntpserver();
             }
 
-            if (ESP_OK == esp_mqtt_client_start(client)) {
+            if (ESP_OK == brokers_start(client)) {
                 xTaskCreate(&update_check_task, "update_check_task", 2048, nullptr, 2, nullptr);
                 init_gpio();
+                init_latency_report();
+#if CONFIG_LEVEL_ADC_ENABLE
+                init_level(&publish_level);
+#endif
                 break;
             }
-            vTaskDelay(2000 / portTICK_PERIOD_MS);
+            vTaskDelay(param_get(PARAM_POLL_MS) / portTICK_PERIOD_MS);
         }
     }
 }
@@ -0,0 +1,411 @@
+/**
+ * Multiple MQTT brokers
+ *
+ * The brokers are CONFIG_MQTTS_URI followed by the (whitespace separated) URIs
+ * in CONFIG_MQTTS_URI_LIST. For each broker, the time from MQTT_EVENT_BEFORE_CONNECT
+ * to MQTT_EVENT_CONNECTED (TCP + TLS + MQTT connect) is measured and smoothed.
+ * Together with the number of consecutive failures, this is used to rank the brokers.
+ * The statistics are kept in NVS, so after a reboot the fastest healthy broker
+ * is tried first.
+ *
+ * The broker task switches to the next broker, if no connection could be
+ * established within CONFIG_MQTT_FAILOVER_TIMEOUT_MS while WiFi is up.
+ * It also schedules reconnects (see broker_task).
+ */
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "brokers.h"
+#include "reconnect.h"
+#include "common.h"
+
+static const char* TAG = "brokers";
+
+#define NOTIFY_START        BIT0
+#define NOTIFY_CONNECTED    BIT1
+#define NOTIFY_DISCONNECTED BIT2
+
+// Stored in NVS, one blob per broker
+typedef struct {
+    uint32_t uri_hash;      // Stats are discarded, if the URI has changed
+    uint32_t connect_ms;    // Smoothed connect time, 0 if unknown
+    uint32_t successes;
+    uint32_t failures;
+    uint32_t fail_streak;   // Consecutive failures
+} broker_health_t;
+
+typedef struct {
+    std::string uri;
+    broker_health_t health;
+} broker_t;
+
+// The list of brokers is fixed after init_brokers(). Their health, the ranking
+// and the statistics are changed by the broker task under rank_lock.
+// rank_lock is never held while calling the MQTT client, because the MQTT task
+// reads the ranking (brokers_current_uri()), while esp_mqtt_client_stop() waits for it.
+static std::vector<broker_t> brokers;
+static std::vector<int> ranking;    // Indices into brokers, best first
+static size_t rank_pos = 0;         // Position of the current broker in ranking
+
+static esp_mqtt_client_handle_t client = nullptr;
+static TaskHandle_t broker_task_handle = nullptr;
+static SemaphoreHandle_t client_lock = nullptr;
+static SemaphoreHandle_t rank_lock = nullptr;
+static volatile bool active = false;
+static volatile int64_t before_connect_us = 0;
+static volatile uint32_t last_connect_ms = 0;
+static volatile int64_t connected_us = 0;
+static brokers_connected_cb_t connected_cb = nullptr;
+
+// Statistics
+static uint32_t failovers = 0;
+static uint32_t last_failover_ms = 0;
+static uint32_t max_failover_ms = 0;
+
+/**
+ * FNV-1a hash of a string
+ */
+static uint32_t hash(const std::string &s) {
+    uint32_t h = 2166136261u;
+    for (char c : s) {
+        h = (h ^ (uint8_t)c) * 16777619u;
+    }
+    return h;
+}
+
+static void load_health(int idx) {
+    broker_t &b = brokers[idx];
+    memset(&b.health, 0, sizeof(b.health));
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("brokers", NVS_READONLY, &nvs_handle);
+    if (ESP_OK == err) {
+        char key[8];
+        snprintf(key, sizeof(key), "b%d", idx);
+        broker_health_t h;
+        size_t sz = sizeof(h);
+        err = nvs_get_blob(nvs_handle, key, &h, &sz);
+        if ((ESP_OK == err) && (sizeof(h) == sz) && (h.uri_hash == hash(b.uri))) {
+            b.health = h;
+        }
+        nvs_close(nvs_handle);
+    }
+    b.health.uri_hash = hash(b.uri);
+}
+
+static void save_health(int idx) {
+    xSemaphoreTake(rank_lock, portMAX_DELAY);
+    broker_health_t h = brokers[idx].health;
+    xSemaphoreGive(rank_lock);
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("brokers", NVS_READWRITE, &nvs_handle);
+    if (ESP_OK == err) {
+        char key[8];
+        snprintf(key, sizeof(key), "b%d", idx);
+        err = nvs_set_blob(nvs_handle, key, &h, sizeof(broker_health_t));
+        if (ESP_OK != err) {
+            ESP_LOGE(TAG, "Unable to write NVS: %s", esp_err_to_name(err));
+            syslog(LOG_ERR, "Unable to write NVS: %s", esp_err_to_name(err));
+        }
+        nvs_commit(nvs_handle);
+        nvs_close(nvs_handle);
+    } else {
+        ESP_LOGE(TAG, "Unable to open NVS: %s", esp_err_to_name(err));
+        syslog(LOG_ERR, "Unable to open NVS: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * Sort brokers: Fewest consecutive failures first, then fastest connect time.
+ * Brokers with unknown connect time come after measured ones.
+ * Must be called with rank_lock held (except from init_brokers()).
+ */
+static void rank() {
+    ranking.clear();
+    for (size_t i = 0; i < brokers.size(); i++) {
+        ranking.push_back(i);
+    }
+    std::stable_sort(ranking.begin(), ranking.end(), [](int a, int b) {
+        const broker_health_t &ha = brokers[a].health;
+        const broker_health_t &hb = brokers[b].health;
+        if (ha.fail_streak != hb.fail_streak) {
+            return ha.fail_streak < hb.fail_streak;
+        }
+        uint32_t ca = ha.connect_ms ? ha.connect_ms : UINT32_MAX;
+        uint32_t cb = hb.connect_ms ? hb.connect_ms : UINT32_MAX;
+        return ca < cb;
+    });
+    rank_pos = 0;
+}
+
+static broker_t &current() {
+    return brokers[ranking[rank_pos]];
+}
+
+typedef enum {
+    ST_CONNECTING,  // Client started, waiting for MQTT_EVENT_CONNECTED
+    ST_CONNECTED,
+    ST_WAITING,     // Client stopped, waiting for the next attempt
+} conn_state_t;
+
+static void stop_client() {
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    if (active) {
+        esp_mqtt_client_stop(client);
+    }
+    xSemaphoreGive(client_lock);
+}
+
+/**
+ * Start the client again.
+ * @param next If true, switch to the next broker in the ranking first.
+ *        After the last one, the brokers are ranked again.
+ * @return The result of esp_mqtt_client_start().
+ */
+static esp_err_t restart_client(bool next) {
+    next = next && (1 < brokers.size());
+    xSemaphoreTake(rank_lock, portMAX_DELAY);
+    if (next) {
+        failovers++;
+        if (++rank_pos >= ranking.size()) {
+            rank();
+        }
+    }
+    const char *uri = current().uri.c_str();
+    xSemaphoreGive(rank_lock);
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    if (active) {
+        if (next) {
+            esp_mqtt_client_set_uri(client, uri);
+        }
+        ret = esp_mqtt_client_start(client);
+    }
+    xSemaphoreGive(client_lock);
+    if (next) {
+        ESP_LOGI(TAG, "Switching to broker %s", uri);
+        syslog(LOG_NOTICE, "Switching to broker %s", uri);
+    }
+    if (ESP_OK != ret) {
+        ESP_LOGE(TAG, "Unable to start MQTT client: %s", esp_err_to_name(ret));
+        syslog(LOG_ERR, "Unable to start MQTT client: %s", esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+/**
+ * Monitors the connection and schedules reconnects.
+ *
+ * The MQTT client's own reconnect is disabled. Instead, after a lost connection
+ * or a failed attempt, the client is stopped and started again after a jittered,
+ * exponentially growing delay. While WiFi is down, nothing is attempted and the
+ * delay starts when WiFi is back, so MQTT reconnects do not follow WiFi reconnects
+ * in the same wave. If an attempt on a broker fails (or does not succeed within
+ * CONFIG_MQTT_FAILOVER_TIMEOUT_MS), the next attempt is made on the next broker.
+ */
+static void broker_task(void * pvParameter) {
+    const int64_t timeout_us = CONFIG_MQTT_FAILOVER_TIMEOUT_MS * 1000LL;
+    conn_state_t state = ST_CONNECTING;
+    int64_t deadline = esp_timer_get_time() + timeout_us;
+    int64_t outage_start = 0;
+    uint32_t delay_ms = 0;
+    bool failed = false;
+    bool wifi_was_down = false;
+    while (true) {
+        TickType_t wait = portMAX_DELAY;
+        if (active && (ST_CONNECTED != state)) {
+            int64_t remaining = deadline - esp_timer_get_time();
+            wait = (0 < remaining) ? (remaining / 1000 / portTICK_PERIOD_MS) + 1 : 0;
+        }
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, wait);
+        int64_t now = esp_timer_get_time();
+        bool wifi_up = (0 != (xEventGroupGetBits(appState) & WIFI_CONNECTED));
+        bool attempt_failed = false;
+        if (bits & NOTIFY_START) {
+            state = ST_CONNECTING;
+            deadline = now + timeout_us;
+        }
+        if (bits & NOTIFY_CONNECTED) {
+            state = ST_CONNECTED;
+            xSemaphoreTake(rank_lock, portMAX_DELAY);
+            int idx = ranking[rank_pos];
+            broker_health_t &h = brokers[idx].health;
+            h.connect_ms = h.connect_ms ? (h.connect_ms * 3 + last_connect_ms) / 4 : last_connect_ms;
+            h.successes++;
+            h.fail_streak = 0;
+            uint32_t connect_ms = h.connect_ms;
+            uint32_t failover_ms = 0;
+            if (0 != outage_start) {
+                failover_ms = last_failover_ms = (now - outage_start) / 1000;
+                if (last_failover_ms > max_failover_ms) {
+                    max_failover_ms = last_failover_ms;
+                }
+                outage_start = 0;
+            }
+            xSemaphoreGive(rank_lock);
+            save_health(idx);
+            if (failover_ms) {
+                ESP_LOGI(TAG, "Reconnected after %u ms", failover_ms);
+            }
+            ESP_LOGD(TAG, "Connect time %u ms, smoothed %u ms", last_connect_ms, connect_ms);
+            // All updates of mqtt_reconnect are done by this task
+            mqtt_reconnect.recovered(connected_us);
+            if (nullptr != connected_cb) {
+                connected_cb();
+            }
+        }
+        // Not else: A connection, which dropped right after CONNACK, delivers both
+        if ((bits & NOTIFY_DISCONNECTED) && (ST_WAITING != state)) {
+            attempt_failed = true;
+        }
+        if (!active) {
+            continue;
+        }
+        if ((ST_CONNECTING == state) && (now >= deadline)) {
+            attempt_failed = true;
+        }
+        if (attempt_failed) {
+            stop_client();
+            mqtt_reconnect.lost(now);
+            if (0 == outage_start) {
+                outage_start = now;
+            }
+            // Only a failed attempt while WiFi is up is the broker's fault
+            failed = (ST_CONNECTING == state) && wifi_up;
+            if (failed) {
+                xSemaphoreTake(rank_lock, portMAX_DELAY);
+                int idx = ranking[rank_pos];
+                brokers[idx].health.failures++;
+                brokers[idx].health.fail_streak++;
+                xSemaphoreGive(rank_lock);
+                save_health(idx);
+            }
+            delay_ms = mqtt_reconnect.next_delay();
+            ESP_LOGD(TAG, "Next attempt in %u ms", delay_ms);
+            state = ST_WAITING;
+            deadline = now + delay_ms * 1000LL;
+        } else if ((ST_WAITING == state) && (now >= deadline)) {
+            if (!wifi_up) {
+                wifi_was_down = true;
+                deadline = now + 1000000LL;
+            } else if (wifi_was_down) {
+                // Start the delay again, now that WiFi is back
+                wifi_was_down = false;
+                deadline = now + delay_ms * 1000LL;
+            } else if (ESP_OK == restart_client(failed)) {
+                state = ST_CONNECTING;
+                deadline = now + timeout_us;
+            } else {
+                // The broker has not been contacted, so this is not its fault.
+                // Retry the same (possibly just switched to) broker after the backoff.
+                failed = false;
+                delay_ms = mqtt_reconnect.next_delay();
+                ESP_LOGD(TAG, "Next attempt in %u ms", delay_ms);
+                deadline = now + delay_ms * 1000LL;
+            }
+        }
+    }
+}
+
+const char *init_brokers() {
+    std::string list = CONFIG_MQTTS_URI " " CONFIG_MQTTS_URI_LIST;
+    size_t pos = 0;
+    while ((brokers.size() < MAX_BROKERS) && (std::string::npos != (pos = list.find_first_not_of(" \t,", pos)))) {
+        size_t end = list.find_first_of(" \t,", pos);
+        broker_t b;
+        b.uri = list.substr(pos, (std::string::npos == end) ? std::string::npos : end - pos);
+        brokers.push_back(b);
+        pos = end;
+    }
+    for (size_t i = 0; i < brokers.size(); i++) {
+        load_health(i);
+        ESP_LOGD(TAG, "Broker %s: %u ms, %u ok, %u failed", brokers[i].uri.c_str(),
+                brokers[i].health.connect_ms, brokers[i].health.successes, brokers[i].health.failures);
+    }
+    client_lock = xSemaphoreCreateMutex();
+    rank_lock = xSemaphoreCreateMutex();
+    rank();
+    return current().uri.c_str();
+}
+
+esp_err_t brokers_start(esp_mqtt_client_handle_t mqtt_client) {
+    client = mqtt_client;
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    esp_err_t ret = esp_mqtt_client_start(client);
+    active = (ESP_OK == ret);
+    xSemaphoreGive(client_lock);
+    if (active) {
+        if (nullptr == broker_task_handle) {
+            xTaskCreate(&broker_task, "broker_task", 3072, nullptr, 3, &broker_task_handle);
+        }
+        xTaskNotify(broker_task_handle, NOTIFY_START, eSetBits);
+    }
+    return ret;
+}
+
+esp_err_t brokers_stop() {
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    active = false;
+    esp_err_t ret = esp_mqtt_client_stop(client);
+    xSemaphoreGive(client_lock);
+    return ret;
+}
+
+const char *brokers_current_uri() {
+    // The URIs themselves never change, only the position in the ranking
+    xSemaphoreTake(rank_lock, portMAX_DELAY);
+    const char *uri = current().uri.c_str();
+    xSemaphoreGive(rank_lock);
+    return uri;
+}
+
+void brokers_before_connect() {
+    before_connect_us = esp_timer_get_time();
+}
+
+void brokers_on_connected(brokers_connected_cb_t cb) {
+    connected_cb = cb;
+}
+
+void brokers_connected() {
+    int64_t now = esp_timer_get_time();
+    last_connect_ms = (now - before_connect_us) / 1000;
+    connected_us = now;
+    if (nullptr != broker_task_handle) {
+        xTaskNotify(broker_task_handle, NOTIFY_CONNECTED, eSetBits);
+    }
+}
+
+void brokers_disconnected() {
+    if (nullptr != broker_task_handle) {
+        xTaskNotify(broker_task_handle, NOTIFY_DISCONNECTED, eSetBits);
+    }
+}
+
+int brokers_stats(const char *id, char *buf, size_t len) {
+    xSemaphoreTake(rank_lock, portMAX_DELAY);
+    int pos = snprintf(buf, len, "{\"id\":\"%s\",\"current\":\"%s\",\"failovers\":%u,"
+            "\"last_failover_ms\":%u,\"max_failover_ms\":%u,\"brokers\":[",
+            id, current().uri.c_str(), failovers, last_failover_ms, max_failover_ms);
+    for (size_t i = 0; i < ranking.size(); i++) {
+        const broker_t &b = brokers[ranking[i]];
+        pos += snprintf(buf + std::min((size_t)pos, len), ((size_t)pos < len) ? len - pos : 0,
+                "%s{\"uri\":\"%s\",\"connect_ms\":%u,\"ok\":%u,\"failed\":%u,\"streak\":%u}",
+                i ? "," : "", b.uri.c_str(), b.health.connect_ms, b.health.successes,
+                b.health.failures, b.health.fail_streak);
+    }
+    pos += snprintf(buf + std::min((size_t)pos, len), ((size_t)pos < len) ? len - pos : 0, "]}");
+    xSemaphoreGive(rank_lock);
+    return pos;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/**
+ * Multiple MQTT brokers with connect time based ranking and failover.
+ */
+
+#define MAX_BROKERS 4
+
+/**
+ * Parse the broker list, load the health statistics from NVS and rank the brokers.
+ * @return The URI of the broker to try first.
+ */
+extern const char *init_brokers();
+
+/**
+ * Start the MQTT client and monitor the connection. Reconnects are scheduled
+ * with a jittered exponential backoff. If no connection could be established within
+ * CONFIG_MQTT_FAILOVER_TIMEOUT_MS, the next attempt is made on the next broker.
+ * The client must have been created with disable_auto_reconnect.
+ */
+extern esp_err_t brokers_start(esp_mqtt_client_handle_t client);
+
+/**
+ * Stop the MQTT client (and failover).
+ */
+extern esp_err_t brokers_stop();
+
+/**
+ * URI of the current broker.
+ */
+extern const char *brokers_current_uri();
+
+typedef void (*brokers_connected_cb_t)();
+
+/**
+ * Register a callback, which is invoked by the broker task after a connection
+ * has been established and the reconnect statistics have been updated.
+ */
+extern void brokers_on_connected(brokers_connected_cb_t cb);
+
+/**
+ * Notifications from the MQTT event handler.
+ */
+extern void brokers_before_connect();
+extern void brokers_connected();
+extern void brokers_disconnected();
+
+/**
+ * Format broker statistics as JSON.
+ * @return The number of characters written (as snprintf).
+ */
+extern int brokers_stats(const char *id, char *buf, size_t len);
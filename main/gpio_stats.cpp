@@ -0,0 +1,70 @@
+#include <cstdio>
+#include "gpio_stats.h"
+
+/**
+ * Exponentially weighted moving average with alpha = 1/4.
+ * The first sample is taken as is.
+ */
+static void ewma(uint32_t &avg, uint32_t sample) {
+    if (0 == avg) {
+        avg = sample;
+    } else {
+        avg = (uint32_t)(((int64_t)avg * 3 + sample) / 4);
+    }
+}
+
+GpioStats::GpioStats(int gpio)
+    : gpio(gpio), cur_level(-1), mark_ms(0), last_change_ms(0), last_rise_ms(0),
+    interval_start_ms(0), state_ms{0, 0}, edges(0), avg_ms{0, 0}, period_ms(0),
+    have_change(false), have_rise(false)
+{
+}
+
+void GpioStats::account(uint32_t now_ms) {
+    if (0 <= cur_level) {
+        state_ms[cur_level] += now_ms - mark_ms;
+    }
+    mark_ms = now_ms;
+}
+
+void GpioStats::update(int level, uint32_t now_ms) {
+    level = level ? 1 : 0;
+    if (level == cur_level) {
+        return;
+    }
+    account(now_ms);
+    if (0 > cur_level) {
+        // Initial level, not a transition
+        cur_level = level;
+        interval_start_ms = now_ms;
+        return;
+    }
+    if (have_change) {
+        // A complete phase of the previous level has ended
+        ewma(avg_ms[cur_level], now_ms - last_change_ms);
+    }
+    if (1 == level) {
+        if (have_rise) {
+            ewma(period_ms, now_ms - last_rise_ms);
+        }
+        last_rise_ms = now_ms;
+        have_rise = true;
+    }
+    cur_level = level;
+    last_change_ms = now_ms;
+    have_change = true;
+    edges++;
+}
+
+int GpioStats::summary(uint32_t now_ms, const char *id, char *buf, size_t len) {
+    account(now_ms);
+    int ret = snprintf(buf, len, "{\"id\":\"%s\",\"gpio\":%d,\"level\":%d,\"uptime_ms\":%u,"
+            "\"interval_ms\":%u,\"low_ms\":%u,\"high_ms\":%u,\"edges\":%u,"
+            "\"last_change_ms\":%u,\"avg_low_ms\":%u,\"avg_high_ms\":%u,\"period_ms\":%u}",
+            id, gpio, cur_level, now_ms, now_ms - interval_start_ms, state_ms[0], state_ms[1], edges,
+            have_change ? last_change_ms : 0, avg_ms[0], avg_ms[1], period_ms);
+    interval_start_ms = now_ms;
+    state_ms[0] = state_ms[1] = 0;
+    edges = 0;
+    return ret;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Rolling statistics of a digital input channel (e.g. a float switch).
+ *
+ * Keeps track of the time spent in each state and the number of transitions
+ * during the current reporting interval, the time of the last change and
+ * smoothed durations of the low/high phases and of a complete cycle
+ * (which gives an estimate of the fill and drain period of a tank).
+ *
+ * All timestamps are milliseconds since boot. They are kept as uint32_t,
+ * so differences stay correct across the wraparound.
+ */
+class GpioStats {
+    public:
+        explicit GpioStats(int gpio);
+
+        /**
+         * Feed the debounced level of the input.
+         * Calls with an unchanged level are ignored.
+         */
+        void update(int level, uint32_t now_ms);
+
+        /**
+         * Format the statistics of the current interval as JSON into buf
+         * and start a new interval.
+         * @return The number of characters written (as snprintf).
+         */
+        int summary(uint32_t now_ms, const char *id, char *buf, size_t len);
+
+        /// Last known level (-1 if unknown).
+        int level() const { return cur_level; }
+
+    private:
+        void account(uint32_t now_ms);
+
+        int gpio;
+        int cur_level;
+        uint32_t mark_ms;           // time from which the current state is not yet accounted
+        uint32_t last_change_ms;    // time of the last transition
+        uint32_t last_rise_ms;      // time of the last low -> high transition
+        uint32_t interval_start_ms;
+        uint32_t state_ms[2];       // time spent in each state during the current interval
+        uint32_t edges;             // transitions during the current interval
+        uint32_t avg_ms[2];         // smoothed duration of a complete low/high phase
+        uint32_t period_ms;         // smoothed duration of a complete cycle
+        bool have_change;
+        bool have_rise;
+};
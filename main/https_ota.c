@@ -30,6 +30,8 @@
 #include "esp_log.h"
 
 #include "common.h"
+#include "params.h"
+#include "trace.h"
 
 static const char *wheel_char = "/-\\|";
 static int wheel_idx = 0;
@@ -39,7 +41,6 @@ static void wheel() {
     wheel_idx = (wheel_idx + 1) % 4;
 }
 
-#define OTA_BUF_SIZE    CONFIG_OTA_BUF_SIZE
 static const char *TAG = "OTA update";
 
 static int invalid_content_type = 0;
@@ -150,6 +151,7 @@ static esp_err_t https_ota(const esp_http_client_config_t *config)
     esp_http_client_fetch_headers(client);
 
     int http_status = esp_http_client_get_status_code(client);
+    trace(TRACE_OTA, TRACE_OTA_RESPONSE, http_status);
     if (304 <= http_status) {
         ESP_LOGI(TAG, "No new firmware available");
         syslog(LOG_NOTICE, "No new firmware available");
@@ -190,9 +192,11 @@ static esp_err_t https_ota(const esp_http_client_config_t *config)
         return err;
     }
     ESP_LOGD(TAG, "esp_ota_begin succeeded");
+    trace(TRACE_OTA, TRACE_OTA_WRITE, 0);
 
     esp_err_t ota_write_err = ESP_OK;
-    char *upgrade_data_buf = (char *)malloc(OTA_BUF_SIZE);
+    const int ota_buf_size = param_get(PARAM_OTA_BUF_SIZE);
+    char *upgrade_data_buf = (char *)malloc(ota_buf_size);
     if (!upgrade_data_buf) {
         ESP_LOGE(TAG, "Could not allocate memory to upgrade data buffer");
         syslog(LOG_ERR, "Could not allocate memory to upgrade data buffer");
@@ -201,7 +205,7 @@ static esp_err_t https_ota(const esp_http_client_config_t *config)
     ESP_LOGI(TAG, "Please wait. This may take time");
     int binary_file_len = 0;
     while (1) {
-        int data_read = esp_http_client_read(client, upgrade_data_buf, OTA_BUF_SIZE);
+        int data_read = esp_http_client_read(client, upgrade_data_buf, ota_buf_size);
         if (data_read == 0) {
             printf("\r\n");
             ESP_LOGD(TAG, "Connection closed,all data received");
@@ -225,6 +229,7 @@ static esp_err_t https_ota(const esp_http_client_config_t *config)
     free(upgrade_data_buf);
     http_cleanup(client); 
     ESP_LOGD(TAG, "Total binary data length writen: %d", binary_file_len);
+    trace(TRACE_OTA, TRACE_OTA_END, binary_file_len);
     
     esp_err_t ota_end_err = esp_ota_end(update_handle);
     if (ota_write_err != ESP_OK) {
@@ -293,6 +298,7 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 void ota_task(void * pvParameter)
 {
     ESP_LOGI(TAG, "Checking %s", CONFIG_OTA_URI);
+    trace(TRACE_OTA, TRACE_OTA_START, 0);
     esp_http_client_config_t config = {
         .url = CONFIG_OTA_URI,
         .cert_pem = (char *)pvParameter,
@@ -308,11 +314,12 @@ void ota_task(void * pvParameter)
         closelog();
         esp_restart();
     } else {
+        trace(TRACE_OTA, TRACE_OTA_FAILED, ret);
         if (ESP_ERR_INVALID_STATE != ret) {
             ESP_LOGE(TAG, "Firmware upgrade failed");
             syslog(LOG_ERR, "Firmware upgrade failed");
         }
-        xEventGroupSetBits(appState, OTA_DONE);
+        trace_set_bits(OTA_DONE);
         vTaskDelete(NULL);
         return;
     }
@@ -0,0 +1,80 @@
+/**
+ * Fixed-bucket latency histograms
+ *
+ * Bucket i counts latencies below bounds[i], the last bucket counts everything else.
+ */
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include "freertos/FreeRTOS.h"
+
+#include "latency.h"
+
+static const uint32_t bounds_us[LAT_NUM_BUCKETS - 1] = {
+    500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000
+};
+
+static const char* stage_names[LAT_STAGE_MAX] = {
+    "isr_queue", "debounce", "outbox", "ack", "total"
+};
+
+static uint32_t hist[LAT_STAGE_MAX][LAT_NUM_BUCKETS];
+static uint32_t max_us[LAT_STAGE_MAX];
+
+/**
+ * snprintf at buf + pos, advancing pos. pos keeps counting beyond len (like snprintf).
+ */
+static void append(char *buf, size_t len, size_t &pos, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = vsnprintf(buf + ((pos < len) ? pos : len), (pos < len) ? len - pos : 0, fmt, ap);
+    va_end(ap);
+    if (0 < ret) {
+        pos += ret;
+    }
+}
+
+void latency_record(lat_stage_t stage, int64_t us) {
+    if (0 > us) {
+        return;
+    }
+    int i = 0;
+    while ((i < (LAT_NUM_BUCKETS - 1)) && (us >= bounds_us[i])) {
+        i++;
+    }
+    portENTER_CRITICAL();
+    hist[stage][i]++;
+    if (us > max_us[stage]) {
+        max_us[stage] = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+    }
+    portEXIT_CRITICAL();
+}
+
+int latency_stats(const char *id, char *buf, size_t len, bool reset) {
+    uint32_t h[LAT_STAGE_MAX][LAT_NUM_BUCKETS];
+    uint32_t m[LAT_STAGE_MAX];
+    portENTER_CRITICAL();
+    memcpy(h, hist, sizeof(h));
+    memcpy(m, max_us, sizeof(m));
+    if (reset) {
+        memset(hist, 0, sizeof(hist));
+        memset(max_us, 0, sizeof(max_us));
+    }
+    portEXIT_CRITICAL();
+
+    size_t pos = 0;
+    append(buf, len, pos, "{\"id\":\"%s\",\"bounds_us\":[", id);
+    for (int i = 0; i < (LAT_NUM_BUCKETS - 1); i++) {
+        append(buf, len, pos, "%s%u", i ? "," : "", bounds_us[i]);
+    }
+    append(buf, len, pos, "]");
+    for (int s = 0; s < LAT_STAGE_MAX; s++) {
+        append(buf, len, pos, ",\"%s\":{\"max_us\":%u,\"hist\":[", stage_names[s], m[s]);
+        for (int i = 0; i < LAT_NUM_BUCKETS; i++) {
+            append(buf, len, pos, "%s%u", i ? "," : "", h[s][i]);
+        }
+        append(buf, len, pos, "]}");
+    }
+    append(buf, len, pos, "}");
+    return pos;
+}
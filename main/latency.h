@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Latency histograms for the path of a GPIO edge from the ISR to the
+ * broker's acknowledgement.
+ */
+typedef enum {
+    LAT_ISR_QUEUE,  // ISR -> dequeued by gpio_task
+    LAT_DEBOUNCE,   // dequeued -> debounced level confirmed
+    LAT_OUTBOX,     // handed to the publisher -> esp_mqtt_client_publish() returned
+    LAT_ACK,        // esp_mqtt_client_publish() returned -> MQTT_EVENT_PUBLISHED
+    LAT_TOTAL,      // ISR -> MQTT_EVENT_PUBLISHED
+    LAT_STAGE_MAX
+} lat_stage_t;
+
+/**
+ * Number of buckets per histogram.
+ */
+#define LAT_NUM_BUCKETS 12
+
+/**
+ * Record a latency (in microseconds) of a stage.
+ */
+extern void latency_record(lat_stage_t stage, int64_t us);
+
+/**
+ * Format all histograms as JSON.
+ * @param reset If true, start new histograms afterwards.
+ * @return The number of characters written (as snprintf).
+ */
+extern int latency_stats(const char *id, char *buf, size_t len, bool reset);
@@ -0,0 +1,113 @@
+/**
+ * Analog level acquisition
+ *
+ * A periodic esp_timer samples the TOUT channel into a small ring buffer.
+ * The level task drains that buffer, runs the samples through LevelFilter
+ * and invokes the report callback if the filtered value has left the deadband
+ * or crossed the hysteresis band.
+ */
+#include "sdkconfig.h"
+
+#if CONFIG_LEVEL_ADC_ENABLE
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "driver/adc.h"
+#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "level.h"
+#include "level_filter.h"
+
+static const char* TAG = "level";
+
+#define RING_SIZE 16 // must be a power of 2
+
+static uint16_t ring[RING_SIZE];
+static volatile uint32_t ring_head = 0;
+static uint32_t ring_tail = 0;
+static volatile uint32_t overruns = 0;
+
+static TaskHandle_t level_task_handle = nullptr;
+static level_report_cb_t report_cb = nullptr;
+static LevelFilter *filter = nullptr;
+static volatile bool force_report = false;
+
+// Statistics, dumped with debug enabled
+static uint32_t samples = 0;
+static uint32_t reports = 0;
+static int64_t filter_us = 0;
+
+/**
+ * Timer callback (runs in the esp_timer task).
+ * Reads one sample into the ring and wakes up the level task.
+ */
+static void sample_cb(void *arg) {
+    uint16_t val;
+    if (ESP_OK == adc_read(&val)) {
+        if ((ring_head - ring_tail) >= RING_SIZE) {
+            overruns++;
+            return;
+        }
+        ring[ring_head & (RING_SIZE - 1)] = val;
+        ring_head++;
+        xTaskNotifyGive(level_task_handle);
+    }
+}
+
+static void level_task(void * pvParameter) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (ring_tail != ring_head) {
+            uint16_t val = ring[ring_tail & (RING_SIZE - 1)];
+            ring_tail++;
+            int64_t t0 = esp_timer_get_time();
+            bool report = filter->add(val);
+            filter_us += esp_timer_get_time() - t0;
+            if (0 == (++samples % 1024)) {
+                ESP_LOGD(TAG, "%u samples, %u reports, %u overruns, %d us/sample", samples, reports,
+                        overruns, (int)(filter_us / samples));
+            }
+            if (force_report) {
+                force_report = false;
+                report = true;
+            }
+            if (report) {
+                reports++;
+                ESP_LOGD(TAG, "level %d, state %d", filter->level(), filter->state());
+                report_cb(filter->level(), filter->state(), filter->state_changed());
+            }
+        }
+    }
+}
+
+void init_level(level_report_cb_t cb) {
+    report_cb = cb;
+    filter = new LevelFilter(CONFIG_LEVEL_MEDIAN_WINDOW, CONFIG_LEVEL_AVG_SHIFT,
+            CONFIG_LEVEL_DEADBAND, CONFIG_LEVEL_THRESHOLD, CONFIG_LEVEL_HYSTERESIS);
+    adc_config_t adc_cfg = {
+        .mode = ADC_READ_TOUT_MODE,
+        .clk_div = 8,
+    };
+    ESP_ERROR_CHECK(adc_init(&adc_cfg));
+
+    xTaskCreate(&level_task, "level_task", 2048, nullptr, 5, &level_task_handle);
+
+    const esp_timer_create_args_t targs = {
+        .callback = &sample_cb,
+        .arg = nullptr,
+        .name = "level_sample",
+    };
+    esp_timer_handle_t timer;
+    ESP_ERROR_CHECK(esp_timer_create(&targs, &timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(timer, CONFIG_LEVEL_SAMPLE_INTERVAL_MS * 1000));
+    ESP_LOGI(TAG, "Sampling TOUT every %d ms", CONFIG_LEVEL_SAMPLE_INTERVAL_MS);
+}
+
+void level_report_now() {
+    force_report = true;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+/**
+ * Analog level acquisition on the TOUT (A0) pin.
+ */
+
+/**
+ * Callback, invoked from the level task, whenever the filtered level
+ * has to be reported.
+ * @param level The filtered level in ADC counts (0 .. 1023).
+ * @param state 1, if above the hysteresis band, 0 if below, -1 if unknown.
+ * @param state_changed true, if state has changed since the last report.
+ */
+typedef void (*level_report_cb_t)(int level, int state, bool state_changed);
+
+/**
+ * Setup ADC, sampling timer and level task.
+ */
+extern void init_level(level_report_cb_t cb);
+
+/**
+ * Report the current filtered level, regardless of deadband (e.g. after connecting).
+ */
+extern void level_report_now();
@@ -0,0 +1,92 @@
+#include "level_filter.h"
+
+LevelFilter::LevelFilter(int median_window, int shift, int deadband, int threshold, int hysteresis)
+    : med_len(median_window), med_idx(0), med_fill(0), avg_shift(shift), avg_idx(0),
+    avg_fill(0), avg_sum(0), filtered(0), reported(-1), cur_state(-1), state_change(false)
+{
+    if (med_len < 1) {
+        med_len = 1;
+    }
+    if (med_len > MAX_MEDIAN) {
+        med_len = MAX_MEDIAN;
+    }
+    med_len |= 1; // must be odd
+    if (avg_shift < 0) {
+        avg_shift = 0;
+    }
+    if (avg_shift > MAX_AVG_SHIFT) {
+        avg_shift = MAX_AVG_SHIFT;
+    }
+    deadband_q4 = deadband << FRAC_BITS;
+    high_q4 = (threshold + hysteresis) << FRAC_BITS;
+    low_q4 = (threshold - hysteresis) << FRAC_BITS;
+}
+
+/**
+ * Running median over the last med_len samples.
+ * Insertion sort on a copy is cheaper than anything fancy for at most 7 entries.
+ */
+uint16_t LevelFilter::median(uint16_t sample) {
+    med_buf[med_idx] = sample;
+    med_idx = (med_idx + 1) % med_len;
+    if (med_fill < med_len) {
+        med_fill++;
+    }
+    uint16_t tmp[MAX_MEDIAN];
+    for (int i = 0; i < med_fill; i++) {
+        uint16_t v = med_buf[i];
+        int j = i;
+        while ((j > 0) && (tmp[j - 1] > v)) {
+            tmp[j] = tmp[j - 1];
+            j--;
+        }
+        tmp[j] = v;
+    }
+    return tmp[med_fill / 2];
+}
+
+bool LevelFilter::add(uint16_t sample) {
+    uint16_t m = median(sample);
+    if (med_fill < med_len) {
+        // Median window not filled yet
+        return false;
+    }
+    int len = 1 << avg_shift;
+    if (avg_fill < len) {
+        avg_buf[avg_idx] = m;
+        avg_sum += m;
+        avg_fill++;
+    } else {
+        avg_sum += m - avg_buf[avg_idx];
+        avg_buf[avg_idx] = m;
+    }
+    avg_idx = (avg_idx + 1) & (len - 1);
+    if (avg_fill < len) {
+        // Not enough samples yet, use the plain average of what we have
+        filtered = (int32_t)((avg_sum << FRAC_BITS) / avg_fill);
+        return false;
+    }
+    filtered = (int32_t)((avg_sum << FRAC_BITS) >> avg_shift);
+
+    state_change = false;
+    int new_state = cur_state;
+    if (filtered >= high_q4) {
+        new_state = 1;
+    } else if (filtered <= low_q4) {
+        new_state = 0;
+    }
+    if (new_state != cur_state) {
+        cur_state = new_state;
+        state_change = true;
+    }
+    int32_t delta = filtered - reported;
+    if (delta < 0) {
+        delta = -delta;
+    }
+    // With a deadband of 0, every change is reported, but not an unchanged value
+    if (state_change || (reported < 0) || ((0 < delta) && (delta >= deadband_q4))) {
+        reported = filtered;
+        return true;
+    }
+    return false;
+}
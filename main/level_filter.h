@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Fixed-point filter for analog level samples.
+ *
+ * Raw 10-bit ADC samples are passed through a short median filter (to get rid of
+ * single-sample spikes), followed by a power-of-two moving average. The result is
+ * kept in Q4 fixed point (1/16 ADC counts), so that a deadband smaller than one
+ * count still works. Reporting is decided by a deadband around the last reported
+ * value and by a hysteresis band around a threshold.
+ *
+ * This does not use any ESP specific stuff, so it can be built on a host as well.
+ */
+class LevelFilter {
+    public:
+        static const int MAX_MEDIAN = 7;
+        static const int MAX_AVG_SHIFT = 5;
+        static const int FRAC_BITS = 4;
+
+        /**
+         * @param median_window Number of samples for the median filter (odd, 1 .. MAX_MEDIAN)
+         * @param avg_shift Moving average length is 2^avg_shift samples (0 .. MAX_AVG_SHIFT)
+         * @param deadband Minimum change (in ADC counts) of the filtered value to report
+         * @param threshold Threshold (in ADC counts) for the high/low state
+         * @param hysteresis Half width (in ADC counts) of the band around threshold
+         */
+        LevelFilter(int median_window, int avg_shift, int deadband, int threshold, int hysteresis);
+
+        /**
+         * Feed one raw sample.
+         * @return true, if the filtered value or the state should be reported.
+         */
+        bool add(uint16_t sample);
+
+        /// Filtered value in ADC counts (rounded).
+        int level() const { return (filtered + (1 << (FRAC_BITS - 1))) >> FRAC_BITS; }
+        /// Filtered value in Q4 fixed point.
+        int32_t level_q4() const { return filtered; }
+        /// Current state relative to the hysteresis band (0 = low, 1 = high, -1 = unknown)
+        int state() const { return cur_state; }
+        /// true, if the last report was caused by a state change.
+        bool state_changed() const { return state_change; }
+
+    private:
+        uint16_t median(uint16_t sample);
+
+        int med_len;
+        int med_idx;
+        int med_fill;
+        uint16_t med_buf[MAX_MEDIAN];
+
+        int avg_shift;
+        int avg_idx;
+        int avg_fill;
+        uint32_t avg_sum;
+        uint16_t avg_buf[1 << MAX_AVG_SHIFT];
+
+        int32_t filtered;
+        int32_t reported;
+        int32_t deadband_q4;
+        int32_t high_q4;
+        int32_t low_q4;
+        int cur_state;
+        bool state_change;
+};
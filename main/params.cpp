@@ -0,0 +1,182 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "nvs.h"
+#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "params.h"
+#include "common.h"
+
+static const char* TAG = "params";
+
+#if CONFIG_GPIO_PUBLISH_EDGES
+#define DEFAULT_PUBLISH_EDGES 1
+#else
+#define DEFAULT_PUBLISH_EDGES 0
+#endif
+
+typedef enum {
+    PARAM_INT,
+    PARAM_BOOL,
+} param_type_t;
+
+typedef struct {
+    const char *name;   // Also used as NVS key, so max. 15 characters
+    param_type_t type;
+    int32_t min;
+    int32_t max;
+    int32_t def;
+    bool live;          // false, if a reboot is required
+} param_desc_t;
+
+static const param_desc_t params[PARAM_MAX] = {
+    /* PARAM_DEBOUNCE_MS      */ { "debounce_ms",    PARAM_INT,  0, 1000, 10, true },
+    /* PARAM_PUBLISH_EDGES    */ { "publish_edges",  PARAM_BOOL, 0, 1, DEFAULT_PUBLISH_EDGES, true },
+    /* PARAM_SUMMARY_INTERVAL */ { "summary_s",      PARAM_INT,  0, 86400, CONFIG_GPIO_SUMMARY_INTERVAL, true },
+    /* PARAM_LATENCY_INTERVAL */ { "latency_s",      PARAM_INT,  0, 86400, CONFIG_LATENCY_REPORT_INTERVAL, true },
+    /* PARAM_GPIO_QUEUE_LEN   */ { "gpio_queue",     PARAM_INT,  2, 64, 10, false },
+    /* PARAM_GPIO_STACK       */ { "gpio_stack",     PARAM_INT,  1024, 8192, 2048, false },
+    /* PARAM_OTA_STACK        */ { "ota_stack",      PARAM_INT,  4096, 16384, 9216, true },
+    /* PARAM_OTA_BUF_SIZE     */ { "ota_buf",        PARAM_INT,  256, 8192, CONFIG_OTA_BUF_SIZE, true },
+    /* PARAM_POLL_MS          */ { "poll_ms",        PARAM_INT,  100, 60000, 2000, true },
+    /* PARAM_INFLIGHT_MAX     */ { "inflight_max",   PARAM_INT,  1, 16, CONFIG_MQTT_INFLIGHT_MAX, true },
+    /* PARAM_OUTBOX_ENTRIES   */ { "outbox_entries", PARAM_INT,  1, 64, CONFIG_MQTT_OUTBOX_ENTRIES, true },
+    /* PARAM_OUTBOX_BYTES     */ { "outbox_bytes",   PARAM_INT,  512, 16384, CONFIG_MQTT_OUTBOX_BYTES, true },
+};
+
+static int32_t values[PARAM_MAX];
+static param_change_cb_t callbacks[PARAM_MAX];
+
+static int find(const char *name) {
+    for (int i = 0; i < PARAM_MAX; i++) {
+        if (0 == strcmp(params[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parse and check a value.
+ * @return false, if the value is invalid or out of bounds.
+ */
+static bool parse(const param_desc_t &p, const char *value, int32_t &result) {
+    if (PARAM_BOOL == p.type) {
+        if ((0 == strcmp(value, "1")) || (0 == strcasecmp(value, "true")) || (0 == strcasecmp(value, "on"))) {
+            result = 1;
+            return true;
+        }
+        if ((0 == strcmp(value, "0")) || (0 == strcasecmp(value, "false")) || (0 == strcasecmp(value, "off"))) {
+            result = 0;
+            return true;
+        }
+        return false;
+    }
+    char *end;
+    long l = strtol(value, &end, 0);
+    if ((end == value) || ('\0' != *end) || (l < p.min) || (l > p.max)) {
+        return false;
+    }
+    result = l;
+    return true;
+}
+
+void init_params(void) {
+    for (int i = 0; i < PARAM_MAX; i++) {
+        values[i] = params[i].def;
+    }
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("params", NVS_READONLY, &nvs_handle);
+    if (ESP_OK != err) {
+        // Namespace does not exist yet, if nothing has been set
+        return;
+    }
+    for (int i = 0; i < PARAM_MAX; i++) {
+        int32_t v;
+        err = nvs_get_i32(nvs_handle, params[i].name, &v);
+        if (ESP_OK == err) {
+            if ((v >= params[i].min) && (v <= params[i].max)) {
+                values[i] = v;
+                ESP_LOGI(TAG, "%s = %d", params[i].name, v);
+            } else {
+                ESP_LOGW(TAG, "Ignoring out of range value %d of %s", v, params[i].name);
+            }
+        } else if (ESP_ERR_NVS_NOT_FOUND != err) {
+            ESP_LOGE(TAG, "Unable to read NVS: %s", esp_err_to_name(err));
+            syslog(LOG_ERR, "Unable to read NVS: %s", esp_err_to_name(err));
+        }
+    }
+    nvs_close(nvs_handle);
+}
+
+int32_t param_get(param_id_t id) {
+    return values[id];
+}
+
+void param_on_change(param_id_t id, param_change_cb_t cb) {
+    callbacks[id] = cb;
+}
+
+esp_err_t param_set(const char *name, const char *value, int32_t *parsed, int *reboot) {
+    int id = find(name);
+    if (0 > id) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const param_desc_t &p = params[id];
+    int32_t v;
+    if (!parse(p, value, v)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("params", NVS_READWRITE, &nvs_handle);
+    if (ESP_OK == err) {
+        err = nvs_set_i32(nvs_handle, p.name, v);
+        if (ESP_OK == err) {
+            err = nvs_commit(nvs_handle);
+        }
+        nvs_close(nvs_handle);
+    }
+    if (ESP_OK != err) {
+        // Not applied either, it would be lost at the next reboot
+        ESP_LOGE(TAG, "Unable to write NVS: %s", esp_err_to_name(err));
+        syslog(LOG_ERR, "Unable to write NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+    *parsed = v;
+    *reboot = !p.live;
+    if (p.live && (values[id] != v)) {
+        values[id] = v;
+        if (nullptr != callbacks[id]) {
+            callbacks[id](v);
+        }
+    }
+    ESP_LOGI(TAG, "%s set to %d%s", p.name, v, p.live ? "" : " (after reboot)");
+    syslog(LOG_NOTICE, "%s set to %d%s", p.name, v, p.live ? "" : " (after reboot)");
+    return ESP_OK;
+}
+
+esp_err_t param_format(const char *name, char *buf, size_t len) {
+    int id = find(name);
+    if (0 > id) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    snprintf(buf, len, "%d", values[id]);
+    return ESP_OK;
+}
+
+int params_json(const char *id, char *buf, size_t len) {
+    size_t pos = snprintf(buf, len, "{\"id\":\"%s\"", id);
+    for (int i = 0; i < PARAM_MAX; i++) {
+        const param_desc_t &p = params[i];
+        int ret = snprintf(buf + ((pos < len) ? pos : len), (pos < len) ? len - pos : 0,
+                ",\"%s\":{\"value\":%d,\"min\":%d,\"max\":%d,\"default\":%d%s}",
+                p.name, values[i], p.min, p.max, p.def, p.live ? "" : ",\"reboot\":true");
+        pos += (0 < ret) ? ret : 0;
+    }
+    int ret = snprintf(buf + ((pos < len) ? pos : len), (pos < len) ? len - pos : 0, "}");
+    return pos + ((0 < ret) ? ret : 0);
+}
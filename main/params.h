@@ -0,0 +1,74 @@
+/**
+ * Runtime tunable parameters
+ *
+ * Each parameter has a type, bounds and a default (mostly taken from sdkconfig).
+ * Values are persisted in NVS and can be read/changed via MQTT.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PARAM_DEBOUNCE_MS,
+    PARAM_PUBLISH_EDGES,
+    PARAM_SUMMARY_INTERVAL,
+    PARAM_LATENCY_INTERVAL,
+    PARAM_GPIO_QUEUE_LEN,
+    PARAM_GPIO_STACK,
+    PARAM_OTA_STACK,
+    PARAM_OTA_BUF_SIZE,
+    PARAM_POLL_MS,
+    PARAM_INFLIGHT_MAX,
+    PARAM_OUTBOX_ENTRIES,
+    PARAM_OUTBOX_BYTES,
+    PARAM_MAX
+} param_id_t;
+
+typedef void (*param_change_cb_t)(int32_t value);
+
+/**
+ * Load all parameters from NVS. Must be called after nvs_flash_init().
+ */
+extern void init_params(void);
+
+/**
+ * Get the current value of a parameter.
+ */
+extern int32_t param_get(param_id_t id);
+
+/**
+ * Register a callback, which is invoked after the value of a parameter has changed.
+ */
+extern void param_on_change(param_id_t id, param_change_cb_t cb);
+
+/**
+ * Set a parameter by name. The value is checked against type and bounds,
+ * persisted in NVS and applied.
+ * @param parsed Set to the parsed value (e.g. 1 for "true"), as it has been persisted.
+ * @param reboot Set to 1, if the new value takes effect only after a reboot.
+ * @return ESP_ERR_NOT_FOUND for an unknown name, ESP_ERR_INVALID_ARG for an invalid value,
+ *         or the NVS error, if the value could not be persisted (it is not applied then).
+ */
+extern esp_err_t param_set(const char *name, const char *value, int32_t *parsed, int *reboot);
+
+/**
+ * Format the value of a parameter by name.
+ * @return ESP_ERR_NOT_FOUND for an unknown name.
+ */
+extern esp_err_t param_format(const char *name, char *buf, size_t len);
+
+/**
+ * Format all parameters as JSON.
+ * @return The number of characters written (as snprintf).
+ */
+extern int params_json(const char *id, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
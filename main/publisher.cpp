@@ -0,0 +1,422 @@
+/**
+ * MQTT publishing layer
+ *
+ * Callers (gpio_task, level task, MQTT event handler) put their messages into
+ * the outbox and return immediately. The outbox is bounded by the number of
+ * entries and by the number of bytes. When full, messages of the lowest priority
+ * are shed first (oldest first); a message is only dropped on arrival, if everything
+ * in the outbox is more important. States of the same channel are coalesced, so
+ * only the newest one is kept.
+ *
+ * A single publisher task takes messages out of the outbox in priority order and
+ * publishes them. The outbox lock is never held while talking to the network, so
+ * callers never block on a congested connection. New messages wake the task with a
+ * task notification, which cannot overflow. Acknowledgements are sent to the task via
+ * a queue and connect/disconnect are passed as counters, so there is no lock ordering
+ * issue with the MQTT client's own lock either, and a burst of messages cannot push
+ * control events out.
+ *
+ * QoS1 messages are limited by an in-flight window of inflight_max
+ * unacknowledged messages. While the window is full, nothing of lower priority is
+ * sent either. Acknowledgements (MQTT_EVENT_PUBLISHED) are correlated by msg_id,
+ * which gives the delivery ratio and latency statistics. Messages which are not
+ * acknowledged within CONFIG_MQTT_ACK_TIMEOUT_MS are counted as lost and leave the
+ * window, so a single lost acknowledgement cannot stall it. Messages carrying the
+ * timestamp of their originating event (e.g. a GPIO edge) are also accounted in
+ * the end-to-end latency histogram.
+ */
+#include <string>
+#include <deque>
+#include <list>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "publisher.h"
+#include "latency.h"
+#include "params.h"
+
+static const char* TAG = "publisher";
+
+typedef struct {
+    int qos;
+    int retain;
+    bool windowed;
+    int prio; // 0 is the highest priority
+} pub_policy_t;
+
+static const pub_policy_t policy[PUB_CLASS_MAX] = {
+    /* PUB_EVENT     */ { 1, 0, true,  0 },
+    /* PUB_STATE     */ { 1, 1, true,  0 },
+    /* PUB_INFO      */ { 1, 0, true,  1 },
+    /* PUB_TELEMETRY */ { 0, 0, false, 2 },
+};
+
+struct PubMsg {
+    pub_class_t cls;
+    std::string key; // non-empty for states
+    std::string topic;
+    std::string data;
+    int64_t origin_us;  // time of the originating event (0 if not traced)
+    int64_t enqueue_us; // time of handing over to the publisher
+
+    size_t size() const {
+        return sizeof(PubMsg) + key.length() + topic.length() + data.length();
+    }
+};
+
+typedef struct {
+    int msg_id;
+    int64_t sent_us;
+    int64_t origin_us;
+} inflight_t;
+
+static esp_mqtt_client_handle_t client = nullptr;
+static std::string state_prefix;
+static TaskHandle_t task = nullptr;
+static xQueueHandle ack_queue = nullptr;    // msg_id of MQTT_EVENT_PUBLISHED
+// Connected, while connects != disconnects. Written outside of the publisher task.
+static volatile uint32_t connects = 0;
+static volatile uint32_t disconnects = 0;
+
+// Owned by the publisher task
+static bool connected = false;
+static std::deque<inflight_t> inflight;
+
+// Protected by outbox_lock
+static SemaphoreHandle_t outbox_lock = nullptr;
+static std::map<std::string, std::string> current_state; // last state per channel
+static std::list<PubMsg *> outbox;
+static size_t outbox_bytes = 0;
+static size_t outbox_peak = 0;
+
+// Statistics
+static uint32_t sent[PUB_CLASS_MAX];
+static uint32_t shed[PUB_CLASS_MAX];
+static uint32_t acked = 0;
+static uint32_t lost = 0;
+static uint32_t expired = 0;
+static uint32_t coalesced = 0;
+static uint32_t failed = 0;
+static int64_t latency_sum_us = 0;
+static int64_t latency_max_us = 0;
+
+static bool window_full() {
+    return inflight.size() >= (size_t)param_get(PARAM_INFLIGHT_MAX);
+}
+
+static void wake() {
+    if (nullptr != task) {
+        xTaskNotifyGive(task);
+    }
+}
+
+/**
+ * Remove a message from the outbox. Must be called with outbox_lock held.
+ */
+static void outbox_remove(std::list<PubMsg *>::iterator it) {
+    outbox_bytes -= (*it)->size();
+    outbox.erase(it);
+}
+
+/**
+ * Find the message to shed in favour of a message of priority prio:
+ * The oldest one of the lowest priority, which is not more important than prio.
+ * Must be called with outbox_lock held.
+ */
+static std::list<PubMsg *>::iterator outbox_victim(int prio) {
+    auto victim = outbox.end();
+    for (auto it = outbox.begin(); it != outbox.end(); ++it) {
+        int p = policy[(*it)->cls].prio;
+        if ((p >= prio) && ((victim == outbox.end()) || (p > policy[(*victim)->cls].prio))) {
+            victim = it;
+        }
+    }
+    return victim;
+}
+
+/**
+ * Put a message into the outbox. Takes ownership of msg.
+ * @return false, if the message had to be dropped.
+ */
+static bool outbox_put(PubMsg *msg) {
+    bool ret = true;
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    if (!msg->key.empty()) {
+        for (auto it = outbox.begin(); it != outbox.end(); ++it) {
+            if ((*it)->key == msg->key) {
+                // superseded, not sent yet
+                delete *it;
+                outbox_remove(it);
+                coalesced++;
+                break;
+            }
+        }
+    }
+    int prio = policy[msg->cls].prio;
+    while (ret && ((outbox.size() >= (size_t)param_get(PARAM_OUTBOX_ENTRIES)) ||
+                (outbox_bytes + msg->size() > (size_t)param_get(PARAM_OUTBOX_BYTES)))) {
+        auto victim = outbox_victim(prio);
+        if (victim == outbox.end()) {
+            ret = false;
+        } else {
+            shed[(*victim)->cls]++;
+            delete *victim;
+            outbox_remove(victim);
+        }
+    }
+    if (ret) {
+        outbox.push_back(msg);
+        outbox_bytes += msg->size();
+        if (outbox_bytes > outbox_peak) {
+            outbox_peak = outbox_bytes;
+        }
+    } else {
+        shed[msg->cls]++;
+        delete msg;
+    }
+    xSemaphoreGive(outbox_lock);
+    return ret;
+}
+
+/**
+ * Take the next message to send out of the outbox: The oldest one of the
+ * highest priority. If that has to wait for a free window slot, nothing is sent.
+ * @return nullptr, if there is nothing to send right now.
+ */
+static PubMsg *outbox_get() {
+    PubMsg *ret = nullptr;
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    auto next = outbox.end();
+    for (auto it = outbox.begin(); it != outbox.end(); ++it) {
+        if ((next == outbox.end()) || (policy[(*it)->cls].prio < policy[(*next)->cls].prio)) {
+            next = it;
+        }
+    }
+    if ((next != outbox.end()) && !(policy[(*next)->cls].windowed && window_full())) {
+        ret = *next;
+        outbox_remove(next);
+    }
+    xSemaphoreGive(outbox_lock);
+    return ret;
+}
+
+/**
+ * Actually publish a message. Takes ownership of msg.
+ */
+static void send(PubMsg *msg) {
+    const pub_policy_t &p = policy[msg->cls];
+    int msg_id = esp_mqtt_client_publish(client, msg->topic.c_str(), msg->data.c_str(),
+            msg->data.length(), p.qos, p.retain);
+    if (0 > msg_id) {
+        ESP_LOGW(TAG, "publish to %s failed", msg->topic.c_str());
+        failed++;
+    } else {
+        int64_t now = esp_timer_get_time();
+        sent[msg->cls]++;
+        if (0 < p.qos) {
+            // The stage histograms describe the path of traced events (GPIO edges) only
+            if (0 < msg->origin_us) {
+                latency_record(LAT_OUTBOX, now - msg->enqueue_us);
+            }
+            inflight_t e = { msg_id, now, msg->origin_us };
+            inflight.push_back(e);
+        }
+    }
+    delete msg;
+}
+
+/**
+ * Send messages from the outbox, as long as connected and the window allows.
+ */
+static void drain() {
+    while (connected) {
+        PubMsg *msg = outbox_get();
+        if (nullptr == msg) {
+            break;
+        }
+        send(msg);
+    }
+}
+
+static void on_published(int msg_id) {
+    for (auto it = inflight.begin(); it != inflight.end(); ++it) {
+        if (it->msg_id == msg_id) {
+            int64_t now = esp_timer_get_time();
+            int64_t lat = now - it->sent_us;
+            if (0 < it->origin_us) {
+                latency_record(LAT_ACK, lat);
+                latency_record(LAT_TOTAL, now - it->origin_us);
+            }
+            latency_sum_us += lat;
+            if (lat > latency_max_us) {
+                latency_max_us = lat;
+            }
+            acked++;
+            inflight.erase(it);
+            return;
+        }
+    }
+    ESP_LOGD(TAG, "ack for unknown msg_id %d", msg_id);
+}
+
+/**
+ * Remove messages from the window, which have not been acknowledged in time.
+ * @return Ticks until the next message expires, portMAX_DELAY if the window is empty.
+ */
+static TickType_t expire_inflight() {
+    int64_t now = esp_timer_get_time();
+    const int64_t timeout_us = CONFIG_MQTT_ACK_TIMEOUT_MS * 1000LL;
+    while (!inflight.empty() && (now - inflight.front().sent_us >= timeout_us)) {
+        ESP_LOGD(TAG, "no ack for msg_id %d", inflight.front().msg_id);
+        expired++;
+        lost++;
+        inflight.pop_front();
+    }
+    if (inflight.empty()) {
+        return portMAX_DELAY;
+    }
+    return (inflight.front().sent_us + timeout_us - now) / 1000 / portTICK_PERIOD_MS + 1;
+}
+
+static void on_connected() {
+    connected = true;
+    // Publish all current states again, the last ones might have been lost.
+    // States of the same channel, which are already in the outbox, are the current ones.
+    std::list<PubMsg *> states;
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    for (auto &s : current_state) {
+        bool queued = false;
+        for (auto m : outbox) {
+            if (m->key == s.first) {
+                queued = true;
+                break;
+            }
+        }
+        if (!queued) {
+            states.push_back(new PubMsg{ PUB_STATE, s.first, state_prefix + s.first, s.second,
+                    0, esp_timer_get_time() });
+        }
+    }
+    xSemaphoreGive(outbox_lock);
+    for (auto m : states) {
+        outbox_put(m);
+    }
+}
+
+static void on_disconnected() {
+    connected = false;
+    // Whatever is in flight now, is not going to be acknowledged by us.
+    lost += inflight.size();
+    inflight.clear();
+}
+
+static void publisher_task(void * pvParameter) {
+    uint32_t seen_connects = 0;
+    TickType_t wait = portMAX_DELAY;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        // Read disconnects first, so that d <= c. Changes in between wake us up again.
+        uint32_t d = disconnects;
+        uint32_t c = connects;
+        bool up = (c != d);
+        if (connected && (!up || (c != seen_connects))) {
+            // Disconnected, or reconnected since we looked last time
+            on_disconnected();
+        }
+        if (!connected && up) {
+            on_connected();
+        }
+        seen_connects = c;
+        int msg_id;
+        while (xQueueReceive(ack_queue, &msg_id, 0)) {
+            on_published(msg_id);
+        }
+        expire_inflight();
+        drain();
+        wait = expire_inflight();
+    }
+}
+
+void init_publisher(esp_mqtt_client_handle_t mqtt_client, const char *id) {
+    client = mqtt_client;
+    state_prefix = std::string(CONFIG_MQTT_STATE_PREFIX) + "/" + id + "/";
+    outbox_lock = xSemaphoreCreateMutex();
+    ack_queue = xQueueCreate(CONFIG_MQTT_REQUEST_QUEUE_LEN, sizeof(int));
+    xTaskCreate(&publisher_task, "publisher_task", 3072, nullptr, 6, &task);
+}
+
+bool publish(pub_class_t cls, const char *topic, const char *data, int64_t origin_us) {
+    bool ret = outbox_put(new PubMsg{ cls, "", topic, data, origin_us, esp_timer_get_time() });
+    wake();
+    return ret;
+}
+
+bool publish_binary(pub_class_t cls, const char *topic, const void *data, size_t len) {
+    bool ret = outbox_put(new PubMsg{ cls, "", topic, std::string((const char *)data, len),
+            0, esp_timer_get_time() });
+    wake();
+    return ret;
+}
+
+bool publish_state(const char *name, const char *value) {
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    current_state[name] = value;
+    xSemaphoreGive(outbox_lock);
+    bool ret = outbox_put(new PubMsg{ PUB_STATE, name, state_prefix + name, value,
+            0, esp_timer_get_time() });
+    wake();
+    return ret;
+}
+
+void publisher_connected() {
+    connects++;
+    wake();
+}
+
+void publisher_disconnected() {
+    if (disconnects != connects) {
+        disconnects = connects;
+        wake();
+    }
+}
+
+void publisher_published(int msg_id) {
+    if (pdTRUE != xQueueSend(ack_queue, &msg_id, 0)) {
+        // The message expires from the window later
+        ESP_LOGW(TAG, "ack queue full");
+    }
+    wake();
+}
+
+size_t publisher_outbox_bytes() {
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    size_t ret = outbox_bytes;
+    xSemaphoreGive(outbox_lock);
+    return ret;
+}
+
+size_t publisher_msg_size(const char *topic, size_t len) {
+    return sizeof(PubMsg) + strlen(topic) + len;
+}
+
+int publisher_stats(const char *id, char *buf, size_t len) {
+    uint32_t shed_qos1 = shed[PUB_EVENT] + shed[PUB_STATE] + shed[PUB_INFO];
+    uint32_t total = acked + lost + shed_qos1 + failed;
+    return snprintf(buf, len, "{\"id\":\"%s\",\"sent\":[%u,%u,%u,%u],\"shed\":[%u,%u,%u,%u],"
+            "\"acked\":%u,\"lost\":%u,\"expired\":%u,\"failed\":%u,\"coalesced\":%u,\"delivery_permille\":%u,"
+            "\"latency_avg_ms\":%u,\"latency_max_ms\":%u,\"outbox_bytes\":%u,\"outbox_peak\":%u}",
+            id, sent[PUB_EVENT], sent[PUB_STATE], sent[PUB_INFO], sent[PUB_TELEMETRY],
+            shed[PUB_EVENT], shed[PUB_STATE], shed[PUB_INFO], shed[PUB_TELEMETRY],
+            acked, lost, expired, failed, coalesced,
+            total ? (uint32_t)((uint64_t)acked * 1000 / total) : 1000,
+            acked ? (uint32_t)(latency_sum_us / acked / 1000) : 0,
+            (uint32_t)(latency_max_us / 1000), (unsigned)outbox_bytes, (unsigned)outbox_peak);
+}
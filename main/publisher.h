@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "mqtt_client.h"
+
+/**
+ * Message classes. Each class has its own QoS/retain policy and priority.
+ * Under backpressure, lower priority messages are shed first.
+ */
+typedef enum {
+    PUB_EVENT,      // Transitions (e.g. GPIO edges), QoS1, highest priority
+    PUB_STATE,      // Retained current state per channel, QoS1, highest priority, coalesced
+    PUB_INFO,       // Informational (start, version), QoS1
+    PUB_TELEMETRY,  // Summaries and statistics, QoS0, lowest priority
+    PUB_CLASS_MAX
+} pub_class_t;
+
+/**
+ * Create the publisher task.
+ * @param client The MQTT client to use.
+ * @param id Our identity, used in state topics.
+ */
+extern void init_publisher(esp_mqtt_client_handle_t client, const char *id);
+
+/**
+ * Put a message into the outbox for publishing. Never blocks on the network.
+ * @param origin_us esp_timer_get_time() of the originating event. If non-zero,
+ *        the latency up to the broker's acknowledgement is recorded.
+ * @return false, if the message had to be dropped, because the outbox
+ *         is full of more important messages.
+ */
+extern bool publish(pub_class_t cls, const char *topic, const char *data, int64_t origin_us = 0);
+
+/**
+ * Same as publish() for binary data.
+ */
+extern bool publish_binary(pub_class_t cls, const char *topic, const void *data, size_t len);
+
+/**
+ * Publish (retained) the current state of a channel to
+ * CONFIG_MQTT_STATE_PREFIX/<id>/<name>. If an older state of the same channel
+ * has not been sent yet, it is replaced. All states are published again
+ * after (re)connecting.
+ */
+extern bool publish_state(const char *name, const char *value);
+
+/**
+ * Notifications from the MQTT event handler.
+ */
+extern void publisher_connected();
+extern void publisher_disconnected();
+extern void publisher_published(int msg_id);
+
+/**
+ * Number of bytes currently in the outbox (as accounted against outbox_bytes).
+ */
+extern size_t publisher_outbox_bytes();
+
+/**
+ * Number of bytes a message will be accounted against outbox_bytes with.
+ */
+extern size_t publisher_msg_size(const char *topic, size_t len);
+
+/**
+ * Format publishing statistics as JSON.
+ * @return The number of characters written (as snprintf).
+ */
+extern int publisher_stats(const char *id, char *buf, size_t len);
@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <algorithm>
+#include "sdkconfig.h"
+
+#include "reconnect.h"
+
+Reconnect wifi_reconnect(CONFIG_WIFI_BACKOFF_BASE_MS, CONFIG_RECONNECT_BACKOFF_MAX_MS);
+Reconnect mqtt_reconnect(CONFIG_MQTT_BACKOFF_BASE_MS, CONFIG_RECONNECT_BACKOFF_MAX_MS);
+
+static uint32_t rnd_state = 2463534242u;
+
+void reconnect_seed(const uint8_t *mac) {
+    // FNV-1a over the MAC, never 0 (xorshift would get stuck)
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 6; i++) {
+        h = (h ^ mac[i]) * 16777619u;
+    }
+    rnd_state = h ? h : 2463534242u;
+}
+
+/**
+ * xorshift32
+ */
+static uint32_t rnd() {
+    uint32_t x = rnd_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rnd_state = x;
+    return x;
+}
+
+Reconnect::Reconnect(uint32_t base_ms, uint32_t max_ms)
+    : base_ms(base_ms), max_ms(max_ms), attempt(0), outage_start_us(0), outages(0),
+    total_attempts(0), last_attempts(0), last_recover_ms(0), max_recover_ms(0)
+{
+}
+
+void Reconnect::lost(int64_t now_us) {
+    if (0 == outage_start_us) {
+        outage_start_us = now_us ? now_us : 1;
+        outages++;
+    }
+}
+
+uint32_t Reconnect::next_delay(uint32_t base) {
+    if (0 == base) {
+        base = base_ms;
+    }
+    uint64_t d = (uint64_t)base << std::min(attempt, (uint32_t)16);
+    if (d > max_ms) {
+        d = max_ms;
+    }
+    attempt++;
+    total_attempts++;
+    uint32_t half = d / 2;
+    return half + (rnd() % (d - half + 1));
+}
+
+void Reconnect::recovered(int64_t now_us) {
+    if (0 != outage_start_us) {
+        last_recover_ms = (now_us - outage_start_us) / 1000;
+        max_recover_ms = std::max(max_recover_ms, last_recover_ms);
+        last_attempts = attempt;
+        outage_start_us = 0;
+    }
+    attempt = 0;
+}
+
+int Reconnect::stats(char *buf, size_t len) const {
+    return snprintf(buf, len, "{\"outages\":%u,\"attempts\":%u,\"last_attempts\":%u,"
+            "\"last_recover_ms\":%u,\"max_recover_ms\":%u,\"down\":%s}",
+            outages, total_attempts, last_attempts, last_recover_ms, max_recover_ms,
+            outage_start_us ? "true" : "false");
+}
+
+int reconnect_stats(const char *id, char *buf, size_t len) {
+    size_t pos = snprintf(buf, len, "{\"id\":\"%s\",\"wifi\":", id);
+    pos += wifi_reconnect.stats(buf + std::min(pos, len), (pos < len) ? len - pos : 0);
+    pos += snprintf(buf + std::min(pos, len), (pos < len) ? len - pos : 0, ",\"mqtt\":");
+    pos += mqtt_reconnect.stats(buf + std::min(pos, len), (pos < len) ? len - pos : 0);
+    pos += snprintf(buf + std::min(pos, len), (pos < len) ? len - pos : 0, "}");
+    return pos;
+}
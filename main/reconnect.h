@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Reconnect scheduling with jittered exponential backoff.
+ *
+ * The delay before attempt n is drawn uniformly from [d/2, d] with
+ * d = min(max, base * 2^n). The random generator is seeded from the MAC,
+ * so that a fleet of sensors, which lost the connection at the same time,
+ * does not come back in lockstep.
+ *
+ * Also keeps track of the number of attempts and of the time it took
+ * to recover from an outage.
+ */
+class Reconnect {
+    public:
+        Reconnect(uint32_t base_ms, uint32_t max_ms);
+
+        /**
+         * The connection has been lost (or could not be established).
+         * Starts the outage timer, if not already running.
+         */
+        void lost(int64_t now_us);
+
+        /**
+         * Register an attempt and return the delay until it should be made.
+         * @param base_ms Overrides the base delay, if non-zero (e.g. for authentication failures).
+         */
+        uint32_t next_delay(uint32_t base_ms = 0);
+
+        /**
+         * The connection has been established. Resets the backoff and
+         * records the time to recover.
+         */
+        void recovered(int64_t now_us);
+
+        /**
+         * Format the statistics as a JSON object.
+         * @return The number of characters written (as snprintf).
+         */
+        int stats(char *buf, size_t len) const;
+
+    private:
+        uint32_t base_ms;
+        uint32_t max_ms;
+        uint32_t attempt;           // attempts since the start of the current outage
+        int64_t outage_start_us;    // 0 if connected
+        uint32_t outages;
+        uint32_t total_attempts;
+        uint32_t last_attempts;     // attempts needed to recover from the last outage
+        uint32_t last_recover_ms;
+        uint32_t max_recover_ms;
+};
+
+/**
+ * Seed the random generator used for the jitter.
+ */
+extern void reconnect_seed(const uint8_t *mac);
+
+extern Reconnect wifi_reconnect;
+extern Reconnect mqtt_reconnect;
+
+/**
+ * Format WiFi and MQTT reconnect statistics as JSON.
+ * @return The number of characters written (as snprintf).
+ */
+extern int reconnect_stats(const char *id, char *buf, size_t len);
@@ -0,0 +1,196 @@
+/**
+ * Binary event trace
+ *
+ * Records are written into a static ring of CONFIG_TRACE_ENTRIES entries.
+ * Writing a record is cheap (no allocation, no formatting), so it can be done
+ * in event handlers and in the GPIO ISR. Tasks protect the write with a critical
+ * section, which also keeps the ISR out. Each record gets a sequence number
+ * (implicitly by its position), so the host can tell, how many records have been
+ * overwritten.
+ *
+ * A dump takes a snapshot of the ring and publishes it in chunks of up to TRACE_CHUNK
+ * records, fewer if a chunk would not fit into outbox_bytes. Each chunk carries its own header, so chunks can be decoded independently.
+ * The chunks are handed to the publisher one at a time by a short-lived task, only
+ * when there is room in the outbox, so a large dump does not shed its own head.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "trace.h"
+#include "publisher.h"
+#include "params.h"
+#include "common.h"
+
+#define TRACE_CHUNK 64
+#define TRACE_DUMP_TIMEOUT_MS 60000
+
+static const char* TAG = "trace";
+
+static trace_rec_t ring[CONFIG_TRACE_ENTRIES];
+static uint32_t next_seq = 0;
+
+typedef struct {
+    std::string topic;
+    uint8_t *buf;       // Chunk buffer (header + TRACE_CHUNK records) followed by the snapshot
+    uint32_t first;
+    uint32_t end;
+} trace_dump_t;
+
+static volatile bool dumping = false;
+
+static inline void put(uint8_t src, uint8_t code, int32_t arg) {
+    uint64_t now = esp_timer_get_time();
+    trace_rec_t &r = ring[next_seq % CONFIG_TRACE_ENTRIES];
+    r.time_lo = (uint32_t)now;
+    r.time_hi = (uint16_t)(now >> 32);
+    r.src = src;
+    r.code = code;
+    r.arg = arg;
+    next_seq++;
+}
+
+void init_trace(void) {
+    memset(ring, 0, sizeof(ring));
+    next_seq = 0;
+    trace(TRACE_BOOT, esp_reset_reason(), 0);
+}
+
+void trace(uint8_t src, uint8_t code, int32_t arg) {
+    portENTER_CRITICAL();
+    put(src, code, arg);
+    portEXIT_CRITICAL();
+}
+
+void trace_isr(uint8_t src, uint8_t code, int32_t arg) {
+    put(src, code, arg);
+}
+
+static void trace_state(trace_state_t code, EventBits_t changed, EventBits_t state) {
+    trace(TRACE_STATE, code, (changed & 0xffff) | ((state & 0xffff) << 16));
+}
+
+EventBits_t trace_set_bits(EventBits_t bits) {
+    EventBits_t old = xEventGroupGetBits(appState);
+    EventBits_t ret = xEventGroupSetBits(appState, bits);
+    if (bits & ~old) {
+        trace_state(TRACE_STATE_SET, bits & ~old, old | bits);
+    }
+    return ret;
+}
+
+EventBits_t trace_clear_bits(EventBits_t bits) {
+    EventBits_t old = xEventGroupGetBits(appState);
+    EventBits_t ret = xEventGroupClearBits(appState, bits);
+    if (bits & old) {
+        trace_state(TRACE_STATE_CLEAR, bits & old, old & ~bits);
+    }
+    return ret;
+}
+
+void trace_consumed_bits(EventBits_t bits) {
+    trace_state(TRACE_STATE_CLEAR, bits, xEventGroupGetBits(appState));
+}
+
+static const size_t chunk_size = sizeof(trace_hdr_t) + TRACE_CHUNK * sizeof(trace_rec_t);
+
+/**
+ * Number of records per chunk, so that a chunk published to topic fits into an empty outbox.
+ */
+static int chunk_records(const char *topic) {
+    size_t limit = param_get(PARAM_OUTBOX_BYTES);
+    size_t overhead = publisher_msg_size(topic, sizeof(trace_hdr_t));
+    size_t n = (limit > overhead) ? (limit - overhead) / sizeof(trace_rec_t) : 1;
+    return (n < 1) ? 1 : (n > TRACE_CHUNK) ? TRACE_CHUNK : n;
+}
+
+/**
+ * Wait until a message of len bytes (as accounted by the publisher) fits into
+ * the outbox next to what is already there.
+ * @return false on timeout (e.g. not connected).
+ */
+static bool wait_outbox(size_t len, int64_t deadline_us) {
+    while (true) {
+        size_t used = publisher_outbox_bytes();
+        if ((0 == used) || (used + len <= (size_t)param_get(PARAM_OUTBOX_BYTES))) {
+            return true;
+        }
+        if (esp_timer_get_time() >= deadline_us) {
+            return false;
+        }
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+}
+
+static void trace_dump_task(void * pvParameter) {
+    trace_dump_t *d = (trace_dump_t *)pvParameter;
+    trace_hdr_t *hdr = (trace_hdr_t *)d->buf;
+    trace_rec_t *recs = (trace_rec_t *)(d->buf + sizeof(trace_hdr_t));
+    trace_rec_t *snapshot = (trace_rec_t *)(d->buf + chunk_size);
+    int64_t deadline = esp_timer_get_time() + TRACE_DUMP_TIMEOUT_MS * 1000LL;
+
+    memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+    hdr->version = TRACE_VERSION;
+    hdr->rec_size = sizeof(trace_rec_t);
+    hdr->next_seq = d->end;
+    hdr->now_us = esp_timer_get_time();
+    uint32_t seq;
+    for (seq = d->first; seq < d->end; seq += hdr->count) {
+        hdr->first_seq = seq;
+        uint32_t n = chunk_records(d->topic.c_str());
+        hdr->count = ((d->end - seq) < n) ? (d->end - seq) : n;
+        for (int i = 0; i < hdr->count; i++) {
+            recs[i] = snapshot[(seq + i) % CONFIG_TRACE_ENTRIES];
+        }
+        size_t len = sizeof(trace_hdr_t) + hdr->count * sizeof(trace_rec_t);
+        if (!wait_outbox(publisher_msg_size(d->topic.c_str(), len), deadline)) {
+            ESP_LOGW(TAG, "Trace dump timed out at record %u", seq);
+            syslog(LOG_WARNING, "Trace dump timed out at record %u", seq);
+            break;
+        }
+        if (!publish_binary(PUB_INFO, d->topic.c_str(), hdr, len)) {
+            ESP_LOGW(TAG, "Dropped trace records %u..%u", seq, seq + hdr->count - 1);
+        }
+    }
+    ESP_LOGD(TAG, "Dumped trace records %u..%u", d->first, seq - 1);
+    free(d->buf);
+    delete d;
+    dumping = false;
+    vTaskDelete(nullptr);
+}
+
+void trace_dump(const char *topic) {
+    if (dumping) {
+        ESP_LOGW(TAG, "Trace dump already running");
+        return;
+    }
+    uint8_t *buf = (uint8_t *)malloc(chunk_size + sizeof(ring));
+    if (nullptr == buf) {
+        ESP_LOGE(TAG, "Could not allocate memory for trace dump");
+        syslog(LOG_ERR, "Could not allocate memory for trace dump");
+        return;
+    }
+    trace_dump_t *d = new trace_dump_t{ topic, buf, 0, 0 };
+
+    portENTER_CRITICAL();
+    d->end = next_seq + 1;
+    d->first = (d->end > CONFIG_TRACE_ENTRIES) ? d->end - CONFIG_TRACE_ENTRIES : 0;
+    put(TRACE_DUMP, 0, d->end - d->first);
+    memcpy(buf + chunk_size, ring, sizeof(ring));
+    portEXIT_CRITICAL();
+
+    dumping = true;
+    if (pdPASS != xTaskCreate(&trace_dump_task, "trace_dump", 2048, d, 4, nullptr)) {
+        ESP_LOGE(TAG, "Could not create trace dump task");
+        free(buf);
+        delete d;
+        dumping = false;
+    }
+}
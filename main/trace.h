@@ -0,0 +1,110 @@
+/**
+ * Binary event trace
+ *
+ * A fixed-size ring of compact binary records (Wi-Fi/IP events, MQTT events,
+ * GPIO edges, OTA phases and appState transitions), each with a microsecond
+ * timestamp. The ring can be dumped over MQTT and decoded/replayed on the host
+ * with tools/trace.py.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAGIC     "ETRC"
+#define TRACE_VERSION   1
+
+/**
+ * Sources of trace records. The meaning of code and arg depends on the source.
+ * Must be kept in sync with tools/trace.py.
+ */
+typedef enum {
+    TRACE_BOOT = 1, // code: esp_reset_reason(), arg: 0
+    TRACE_WIFI,     // code: WIFI_EVENT id, arg: disconnect reason
+    TRACE_IP,       // code: IP_EVENT id, arg: IPv4 address
+    TRACE_MQTT,     // code: MQTT event id, arg: msg_id
+    TRACE_GPIO,     // code: GPIO number, arg: level (recorded in the ISR)
+    TRACE_OTA,      // code: trace_ota_t, arg: phase specific (HTTP status, length, error)
+    TRACE_STATE,    // code: trace_state_t, arg: changed bits | (new appState << 16)
+    TRACE_DUMP,     // code: 0, arg: number of records in the dump
+} trace_src_t;
+
+typedef enum {
+    TRACE_OTA_START,    // arg: 0
+    TRACE_OTA_RESPONSE, // arg: HTTP status
+    TRACE_OTA_WRITE,    // arg: 0, after esp_ota_begin()
+    TRACE_OTA_END,      // arg: image length
+    TRACE_OTA_FAILED,   // arg: esp_err_t
+} trace_ota_t;
+
+typedef enum {
+    TRACE_STATE_SET,
+    TRACE_STATE_CLEAR,
+} trace_state_t;
+
+/**
+ * A trace record as stored in the ring and in dumps (little endian).
+ */
+typedef struct {
+    uint32_t time_lo;   // esp_timer_get_time(), lower 32 bits
+    uint16_t time_hi;   // esp_timer_get_time(), bits 32..47
+    uint8_t src;        // trace_src_t
+    uint8_t code;
+    int32_t arg;
+} trace_rec_t;
+
+/**
+ * Header of each dump chunk, followed by count records.
+ */
+typedef struct {
+    char magic[4];      // TRACE_MAGIC
+    uint8_t version;    // TRACE_VERSION
+    uint8_t rec_size;   // sizeof(trace_rec_t)
+    uint16_t count;     // Number of records in this chunk
+    uint32_t first_seq; // Sequence number of the first record in this chunk
+    uint32_t next_seq;  // Sequence number of the next record to be written at the time of the dump
+    uint64_t now_us;    // esp_timer_get_time() at the time of the dump
+} trace_hdr_t;
+
+/**
+ * Clear the ring and record the reset reason. Must be called after creating appState.
+ */
+extern void init_trace(void);
+
+/**
+ * Append a record to the ring. Must not be called from an ISR.
+ */
+extern void trace(uint8_t src, uint8_t code, int32_t arg);
+
+/**
+ * Append a record to the ring from an ISR.
+ */
+extern void trace_isr(uint8_t src, uint8_t code, int32_t arg);
+
+/**
+ * Set/clear bits in appState and record the transition, if any bit has changed.
+ * @return The value of xEventGroupSetBits()/xEventGroupClearBits().
+ */
+extern EventBits_t trace_set_bits(EventBits_t bits);
+extern EventBits_t trace_clear_bits(EventBits_t bits);
+
+/**
+ * Record bits, which have been cleared by xEventGroupWaitBits() on exit.
+ */
+extern void trace_consumed_bits(EventBits_t bits);
+
+/**
+ * Take a snapshot of the ring and publish it as binary chunks to topic.
+ * The chunks are published in the background, as the outbox drains.
+ */
+extern void trace_dump(const char *topic);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,144 @@
+#!/bin/bash
+#
+# Local multi-broker setup for testing failover.
+#
+# Starts three mosquitto instances with TLS and client certificate authentication
+# (ports 8883, 8884 and 8885), stops the broker the sensor is connected to and
+# shows the failover time measured by the sensor (last_failover_ms).
+# Each instance also has a plain listener on localhost (ports 18883, 18884 and 18885)
+# for monitoring by this script.
+#
+# Usage:
+#   tools/brokers-test.sh start    Start the brokers and print the menuconfig settings
+#   tools/brokers-test.sh failover Wait for the sensor, stop its broker, show the stats
+#   tools/brokers-test.sh stop     Stop all brokers
+#
+# Environment:
+#   CA_CRT      CA certificate, which signed the sensor's client certificate
+#               (default: main/ca.crt)
+#   SERVER_CRT  Server certificate for this host, signed by the same CA.
+#               Its CN/SAN must match HOST.
+#   SERVER_KEY  Key of the server certificate
+#   HOST        Host name of this machine as seen from the sensor (default: hostname -f)
+#   CN          CN of the sensor's client certificate (default: taken from main/client.crt)
+#   WORKDIR     Directory for configs, logs and pid files (default: /tmp/brokers-test)
+#
+# Before flashing, set in "make menuconfig":
+#   CONFIG_MQTTS_URI        mqtts://HOST:8883
+#   CONFIG_MQTTS_URI_LIST   mqtts://HOST:8884 mqtts://HOST:8885
+# (The start command prints the exact values.) A short CONFIG_MQTT_FAILOVER_TIMEOUT_MS
+# (e.g. 5000) makes the failover quicker to observe.
+
+set -e
+
+TOPDIR=$(cd "$(dirname "$0")/.." && pwd)
+CA_CRT=${CA_CRT:-$TOPDIR/main/ca.crt}
+HOST=${HOST:-$(hostname -f)}
+WORKDIR=${WORKDIR:-/tmp/brokers-test}
+PORTS="8883 8884 8885"
+
+if [ -z "$CN" ] && [ -f "$TOPDIR/main/client.crt" ] ; then
+    CN=$(openssl x509 -noout -subject -in "$TOPDIR/main/client.crt" -nameopt sep_multiline | sed -n 's/^ *CN=//p')
+fi
+
+monitor_port() {
+    echo $(($1 + 10000))
+}
+
+start() {
+    if [ -z "$SERVER_CRT" ] || [ -z "$SERVER_KEY" ] ; then
+        echo "SERVER_CRT and SERVER_KEY must be set" >&2
+        exit 1
+    fi
+    mkdir -p "$WORKDIR"
+    for port in $PORTS ; do
+        cat > "$WORKDIR/mosquitto-$port.conf" <<EOC
+per_listener_settings true
+pid_file $WORKDIR/mosquitto-$port.pid
+log_dest file $WORKDIR/mosquitto-$port.log
+log_type all
+
+listener $port
+cafile $CA_CRT
+certfile $SERVER_CRT
+keyfile $SERVER_KEY
+require_certificate true
+use_identity_as_username true
+
+listener $(monitor_port $port) 127.0.0.1
+allow_anonymous true
+EOC
+        mosquitto -d -c "$WORKDIR/mosquitto-$port.conf"
+        echo "Started broker on port $port"
+    done
+    echo
+    echo "Settings for make menuconfig:"
+    echo "  CONFIG_MQTTS_URI=mqtts://$HOST:8883"
+    echo "  CONFIG_MQTTS_URI_LIST=mqtts://$HOST:8884 mqtts://$HOST:8885"
+}
+
+stop() {
+    for port in $PORTS ; do
+        if [ -f "$WORKDIR/mosquitto-$port.pid" ] ; then
+            kill $(cat "$WORKDIR/mosquitto-$port.pid") 2>/dev/null || true
+            rm -f "$WORKDIR/mosquitto-$port.pid"
+        fi
+    done
+}
+
+# Wait until the sensor connects to one of the given brokers, print its port
+wait_start() {
+    local timeout=$1
+    shift
+    local pids=""
+    rm -f "$WORKDIR/connected"
+    for port in "$@" ; do
+        (mosquitto_sub -p $(monitor_port $port) -t esp8266/start -C 1 -W $timeout > /dev/null 2>&1 \
+            && echo $port > "$WORKDIR/connected") &
+        pids="$pids $!"
+    done
+    while [ ! -s "$WORKDIR/connected" ] ; do
+        if ! kill -0 $pids 2>/dev/null ; then
+            sleep 1
+            [ -s "$WORKDIR/connected" ] || return 1
+        fi
+        sleep 0.1
+    done
+    kill $pids 2>/dev/null || true
+    cat "$WORKDIR/connected"
+}
+
+failover() {
+    if [ -z "$CN" ] ; then
+        echo "CN must be set" >&2
+        exit 1
+    fi
+    echo "Waiting for $CN to connect (reboot it now) ..."
+    local port
+    port=$(wait_start 300 $PORTS) || { echo "Sensor did not connect" >&2 ; exit 1 ; }
+    echo "Connected to port $port, stopping that broker"
+    local others=""
+    for p in $PORTS ; do
+        [ "$p" = "$port" ] || others="$others $p"
+    done
+    local t0=$(date +%s%N)
+    kill $(cat "$WORKDIR/mosquitto-$port.pid")
+    rm -f "$WORKDIR/mosquitto-$port.pid"
+    local newport
+    newport=$(wait_start 600 $others) || { echo "Sensor did not reconnect" >&2 ; exit 1 ; }
+    local t1=$(date +%s%N)
+    echo "Reconnected to port $newport after $(( (t1 - t0) / 1000000 )) ms (as seen by this script)"
+    # Ask the sensor for its broker statistics, last_failover_ms is its own measurement
+    mosquitto_sub -p $(monitor_port $newport) -t "esp8266-telemetry/$CN/stats/brokers" -C 1 -W 30 &
+    local sub=$!
+    sleep 1
+    mosquitto_pub -p $(monitor_port $newport) -t esp8266/stats -m "$CN"
+    wait $sub
+}
+
+case "$1" in
+    start) start ;;
+    stop) stop ;;
+    failover) failover ;;
+    *) sed -n '2,/^$/s/^# \{0,1\}//p' "$0" ; exit 1 ;;
+esac
@@ -0,0 +1,275 @@
+/**
+ * Host test bench for LevelFilter
+ *
+ * Replays synthetic tank-level signals (fill/drain ramps with noise and spikes)
+ * or a recorded CSV through the filter and prints:
+ *  - CPU time per sample (ns, host CPU)
+ *  - reports per 1000 samples (i.e. publish rate)
+ *  - samples from the true threshold crossing to the state change (detection latency)
+ *
+ * Build and run with "make -C tools bench" or
+ * "tools/level_bench [options] [file.csv]".
+ *
+ * A CSV has one raw ADC sample per line, optionally followed by a second column
+ * with the noise-free level, which is used as the reference for the detection
+ * latency. Without it, the first raw sample outside the hysteresis band is used.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "../main/level_filter.h"
+
+struct Params {
+    int median = 5;
+    int shift = 3;
+    int deadband = 8;
+    int threshold = 512;
+    int hysteresis = 16;
+    int interval_ms = 100;
+};
+
+struct Signal {
+    std::string name;
+    std::vector<uint16_t> raw;
+    std::vector<int> truth; // noise-free level, may be empty
+};
+
+struct Result {
+    double ns_per_sample;
+    double reports_per_1000;
+    int state_changes;
+    std::vector<int> latencies; // samples per detected crossing, MISSED if not detected
+};
+
+static const int MISSED = 0x7fffffff;
+
+/**
+ * Deterministic pseudo random numbers, so that runs are comparable.
+ */
+static uint32_t rnd_state = 1;
+static uint32_t rnd() {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/// Approximately normal distributed noise (sum of 4 uniforms)
+static int noise(int amplitude) {
+    if (0 == amplitude) {
+        return 0;
+    }
+    int sum = 0;
+    for (int i = 0; i < 4; i++) {
+        sum += (int)(rnd() % (2 * amplitude + 1)) - amplitude;
+    }
+    return sum / 2;
+}
+
+static uint16_t clamp(int v) {
+    return (v < 0) ? 0 : ((v > 1023) ? 1023 : v);
+}
+
+/**
+ * Fill from low to high, hold, drain back to low, hold.
+ */
+static Signal synthetic(const char *name, int samples, int noise_amp, int spike_every) {
+    Signal s;
+    s.name = name;
+    rnd_state = 1;
+    const int low = 200, high = 800;
+    int ramp = samples * 3 / 8;
+    int hold = samples / 8;
+    for (int i = 0; i < samples; i++) {
+        int t = i;
+        int level;
+        if (t < hold) {
+            level = low;
+        } else if ((t -= hold) < ramp) {
+            level = low + (high - low) * t / ramp;
+        } else if ((t -= ramp) < hold) {
+            level = high;
+        } else if ((t -= hold) < ramp) {
+            level = high - (high - low) * t / ramp;
+        } else {
+            level = low;
+        }
+        int v = level + noise(noise_amp);
+        if ((0 < spike_every) && (0 == (i % spike_every))) {
+            v = (rnd() & 1) ? 1023 : 0;
+        }
+        s.raw.push_back(clamp(v));
+        s.truth.push_back(level);
+    }
+    return s;
+}
+
+static bool load_csv(const char *fname, Signal &s) {
+    FILE *f = fopen(fname, "r");
+    if (nullptr == f) {
+        perror(fname);
+        return false;
+    }
+    s.name = fname;
+    char line[128];
+    bool has_truth = true;
+    while (fgets(line, sizeof(line), f)) {
+        int raw, truth;
+        int n = sscanf(line, "%d%*[ ,;\t]%d", &raw, &truth);
+        if (1 > n) {
+            continue; // header or empty line
+        }
+        s.raw.push_back(clamp(raw));
+        s.truth.push_back(truth);
+        has_truth = has_truth && (2 == n);
+    }
+    fclose(f);
+    if (!has_truth) {
+        s.truth.clear();
+    }
+    return !s.raw.empty();
+}
+
+/**
+ * Indexes, where the reference crosses the hysteresis band, with the new state.
+ */
+static std::vector<std::pair<size_t, int>> crossings(const Signal &s, const Params &p) {
+    std::vector<std::pair<size_t, int>> ret;
+    int state = -1;
+    for (size_t i = 0; i < s.raw.size(); i++) {
+        int v = s.truth.empty() ? s.raw[i] : s.truth[i];
+        int new_state = state;
+        if (v >= p.threshold + p.hysteresis) {
+            new_state = 1;
+        } else if (v <= p.threshold - p.hysteresis) {
+            new_state = 0;
+        }
+        if (new_state != state) {
+            if (-1 != state) {
+                ret.push_back(std::make_pair(i, new_state));
+            }
+            state = new_state;
+        }
+    }
+    return ret;
+}
+
+static Result run(const Signal &s, const Params &p) {
+    Result r;
+    // Timing: replay the signal often enough to get a stable measurement
+    const int runs = (s.raw.size() < 1000000) ? (int)(2000000 / s.raw.size()) + 1 : 1;
+    volatile int sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < runs; n++) {
+        LevelFilter f(p.median, p.shift, p.deadband, p.threshold, p.hysteresis);
+        for (uint16_t v : s.raw) {
+            sink += f.add(v);
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    r.ns_per_sample = (double)elapsed / ((double)runs * s.raw.size());
+
+    // Behaviour: one more run, recording reports and state changes
+    LevelFilter f(p.median, p.shift, p.deadband, p.threshold, p.hysteresis);
+    std::vector<std::pair<size_t, int>> changes;
+    int reports = 0;
+    int last_state = -1;
+    for (size_t i = 0; i < s.raw.size(); i++) {
+        if (f.add(s.raw[i])) {
+            reports++;
+        }
+        if (f.state() != last_state) {
+            if (-1 != last_state) {
+                changes.push_back(std::make_pair(i, f.state()));
+            }
+            last_state = f.state();
+        }
+    }
+    r.reports_per_1000 = 1000.0 * reports / s.raw.size();
+    r.state_changes = changes.size();
+
+    // Match each reference crossing with the first state change to the same state
+    // after the previous crossing. Noise can make the filter cross a bit early,
+    // so the latency can be negative.
+    size_t c = 0;
+    for (auto &x : crossings(s, p)) {
+        while ((c < changes.size()) && (changes[c].second != x.second)) {
+            c++;
+        }
+        if (c < changes.size()) {
+            r.latencies.push_back((int)changes[c].first - (int)x.first);
+            c++;
+        } else {
+            r.latencies.push_back(MISSED);
+        }
+    }
+    return r;
+}
+
+static void print(const Signal &s, const Result &r, const Params &p) {
+    double per_s = r.reports_per_1000 * 1000.0 / (1000.0 * p.interval_ms);
+    printf("%-22s %8zu %10.1f %12.1f %10.2f %8d  ", s.name.c_str(), s.raw.size(),
+            r.ns_per_sample, r.reports_per_1000, per_s, r.state_changes);
+    if (r.latencies.empty()) {
+        printf("-");
+    }
+    for (int l : r.latencies) {
+        if (MISSED == l) {
+            printf("missed ");
+        } else {
+            printf("%d (%d ms) ", l, l * p.interval_ms);
+        }
+    }
+    printf("\n");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m median] [-a avg_shift] [-d deadband] [-t threshold]\n"
+            "       [-H hysteresis] [-i interval_ms] [file.csv ...]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    Params p;
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "m:a:d:t:H:i:h"))) {
+        switch (opt) {
+            case 'm': p.median = atoi(optarg); break;
+            case 'a': p.shift = atoi(optarg); break;
+            case 'd': p.deadband = atoi(optarg); break;
+            case 't': p.threshold = atoi(optarg); break;
+            case 'H': p.hysteresis = atoi(optarg); break;
+            case 'i': p.interval_ms = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    std::vector<Signal> signals;
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            Signal s;
+            if (!load_csv(argv[i], s)) {
+                return 1;
+            }
+            signals.push_back(s);
+        }
+    } else {
+        signals.push_back(synthetic("ramp", 20000, 0, 0));
+        signals.push_back(synthetic("ramp+noise", 20000, 8, 0));
+        signals.push_back(synthetic("ramp+noise+spikes", 20000, 8, 97));
+        signals.push_back(synthetic("ramp+heavy noise", 20000, 32, 0));
+    }
+    printf("median=%d avg=2^%d deadband=%d threshold=%d hysteresis=%d interval=%dms\n",
+            p.median, p.shift, p.deadband, p.threshold, p.hysteresis, p.interval_ms);
+    printf("%-22s %8s %10s %12s %10s %8s  %s\n", "signal", "samples", "ns/sample",
+            "reports/1000", "reports/s", "changes", "detection latency (samples)");
+    for (auto &s : signals) {
+        print(s, run(s, p), p);
+    }
+    return 0;
+}
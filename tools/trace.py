@@ -0,0 +1,318 @@
+#!/usr/bin/env python3
+"""
+Decode and replay binary event traces of esp8266-sensor.
+
+Request a dump and capture it (as hex, one chunk per line):
+
+    mosquitto_sub -t 'esp8266-trace/<CN>' -F %x > trace.hex &
+    mosquitto_pub -t esp8266/trace -m '<CN>'
+
+Then print the timeline:
+
+    tools/trace.py trace.hex
+
+or replay it through a model of the firmware's appState state machine, which
+checks its invariants and reports timings (WiFi/MQTT outages, time to reconnect,
+debouncing of GPIO edges). The replay only depends on the recorded timestamps,
+so it is deterministic and can be repeated with different parameters, e.g.:
+
+    tools/trace.py --replay --debounce-ms 50 trace.hex
+
+Input files may contain raw binary chunks (concatenated) or hex lines.
+The record layout must match main/trace.h.
+"""
+
+import argparse
+import struct
+import sys
+from collections import Counter
+
+MAGIC = b'ETRC'
+VERSION = 1
+HDR = struct.Struct('<4sBBHIIQ')
+REC = struct.Struct('<IHBBi')
+
+# trace_src_t
+TRACE_BOOT, TRACE_WIFI, TRACE_IP, TRACE_MQTT, TRACE_GPIO, TRACE_OTA, TRACE_STATE, TRACE_DUMP = range(1, 9)
+SOURCES = {
+    TRACE_BOOT: 'BOOT', TRACE_WIFI: 'WIFI', TRACE_IP: 'IP', TRACE_MQTT: 'MQTT',
+    TRACE_GPIO: 'GPIO', TRACE_OTA: 'OTA', TRACE_STATE: 'STATE', TRACE_DUMP: 'DUMP',
+}
+
+RESET_REASONS = ['UNKNOWN', 'POWERON', 'EXT', 'SW', 'PANIC', 'INT_WDT', 'TASK_WDT',
+                 'WDT', 'DEEPSLEEP', 'BROWNOUT', 'SDIO']
+WIFI_EVENTS = ['WIFI_READY', 'SCAN_DONE', 'STA_START', 'STA_STOP', 'STA_CONNECTED',
+               'STA_DISCONNECTED', 'STA_AUTHMODE_CHANGE']
+WIFI_STA_DISCONNECTED = 5
+IP_EVENTS = ['STA_GOT_IP', 'STA_LOST_IP']
+MQTT_EVENTS = ['ERROR', 'CONNECTED', 'DISCONNECTED', 'SUBSCRIBED', 'UNSUBSCRIBED',
+               'PUBLISHED', 'DATA', 'BEFORE_CONNECT']
+OTA_PHASES = ['START', 'RESPONSE', 'WRITE', 'END', 'FAILED']
+STATE_OPS = ['SET', 'CLEAR']
+
+# appState bits, see main/app.cpp
+WIFI_CONNECTED, MQTT_CONNECTED, OTA_REQUIRED, OTA_DONE, NTP_SYNCED = 1, 2, 4, 8, 16
+BITS = [(WIFI_CONNECTED, 'WIFI_CONNECTED'), (MQTT_CONNECTED, 'MQTT_CONNECTED'),
+        (OTA_REQUIRED, 'OTA_REQUIRED'), (OTA_DONE, 'OTA_DONE'), (NTP_SYNCED, 'NTP_SYNCED')]
+
+
+def name(table, idx):
+    return table[idx] if 0 <= idx < len(table) else str(idx)
+
+
+def bits_str(bits):
+    names = [n for b, n in BITS if bits & b]
+    rest = bits & ~sum(b for b, _ in BITS)
+    if rest:
+        names.append('0x%x' % rest)
+    return '|'.join(names) if names else '0'
+
+
+class Record:
+    def __init__(self, seq, time_us, src, code, arg):
+        self.seq = seq
+        self.time_us = time_us
+        self.src = src
+        self.code = code
+        self.arg = arg
+
+    def describe(self):
+        src, code, arg = self.src, self.code, self.arg
+        if TRACE_BOOT == src:
+            return 'reset reason %s' % name(RESET_REASONS, code)
+        if TRACE_WIFI == src:
+            if WIFI_STA_DISCONNECTED == code:
+                return '%s reason=%d' % (name(WIFI_EVENTS, code), arg)
+            return name(WIFI_EVENTS, code)
+        if TRACE_IP == src:
+            return '%s %d.%d.%d.%d' % ((name(IP_EVENTS, code),) + tuple(struct.pack('<I', arg & 0xffffffff)))
+        if TRACE_MQTT == src:
+            return '%s msg_id=%d' % (name(MQTT_EVENTS, code), arg)
+        if TRACE_GPIO == src:
+            return 'GPIO%d level=%d' % (code, arg)
+        if TRACE_OTA == src:
+            return '%s %d' % (name(OTA_PHASES, code), arg)
+        if TRACE_STATE == src:
+            return '%s %s -> %s' % (name(STATE_OPS, code), bits_str(arg & 0xffff), bits_str(arg >> 16))
+        if TRACE_DUMP == src:
+            return '%d records' % arg
+        return 'code=%d arg=%d' % (code, arg)
+
+
+def parse_chunks(data, fname):
+    """Parse concatenated chunks, yield (header, records)."""
+    pos = 0
+    while pos + HDR.size <= len(data):
+        magic, version, rec_size, count, first_seq, next_seq, now_us = HDR.unpack_from(data, pos)
+        if MAGIC != magic or VERSION != version or REC.size != rec_size:
+            raise ValueError('%s: invalid chunk header at offset %d' % (fname, pos))
+        pos += HDR.size
+        if pos + count * rec_size > len(data):
+            raise ValueError('%s: truncated chunk at offset %d' % (fname, pos))
+        records = []
+        for i in range(count):
+            lo, hi, src, code, arg = REC.unpack_from(data, pos + i * rec_size)
+            records.append(Record(first_seq + i, (hi << 32) | lo, src, code, arg))
+        pos += count * rec_size
+        yield (next_seq, now_us), records
+
+
+def read_input(fname):
+    f = sys.stdin.buffer if '-' == fname else open(fname, 'rb')
+    with f:
+        data = f.read()
+    if data.startswith(MAGIC):
+        return [data]
+    # One hex encoded chunk per line (mosquitto_sub -F %x)
+    return [bytes.fromhex(line.strip()) for line in data.decode('ascii').splitlines() if line.strip()]
+
+
+def load(fnames):
+    """Merge the records of all chunks of all files, ordered by sequence number."""
+    records = {}
+    dumps = set()
+    for fname in fnames:
+        for data in read_input(fname):
+            for hdr, recs in parse_chunks(data, fname):
+                dumps.add(hdr)
+                for r in recs:
+                    records[r.seq] = r
+    return [records[s] for s in sorted(records)], sorted(dumps)
+
+
+def print_timeline(records, dumps):
+    for next_seq, now_us in dumps:
+        print('# dump at %.6fs, next_seq=%d' % (now_us / 1e6, next_seq))
+    if not records:
+        return
+    if records[0].seq:
+        print('# %d older records have been overwritten' % records[0].seq)
+    prev = None
+    for r in records:
+        if prev is not None and r.seq != prev.seq + 1:
+            print('# %d records missing' % (r.seq - prev.seq - 1))
+        delta = '' if prev is None else '+%.3fms' % ((r.time_us - prev.time_us) / 1e3)
+        print('%12.6f %12s %6d  %-5s %s' % (r.time_us / 1e6, delta, r.seq,
+                                            SOURCES.get(r.src, str(r.src)), r.describe()))
+        prev = r
+
+
+class Durations:
+    def __init__(self):
+        self.values = []
+
+    def add(self, us):
+        self.values.append(us)
+
+    def __str__(self):
+        if not self.values:
+            return 'n=0'
+        v = sorted(self.values)
+        return 'n=%d min=%.1fms median=%.1fms max=%.1fms' % (
+            len(v), v[0] / 1e3, v[len(v) // 2] / 1e3, v[-1] / 1e3)
+
+
+class Replay:
+    """
+    Model of the firmware's appState event group and connection state machine.
+    Records are fed in order; the model checks invariants and collects timings.
+    """
+
+    def __init__(self, debounce_us):
+        self.debounce_us = debounce_us
+        self.state = None               # unknown until the first STATE record
+        self.problems = []
+        self.wifi_down_since = None
+        self.mqtt_down_since = None
+        self.wifi_up_at = None
+        self.ota_started = False
+        self.wifi_outages = Durations()
+        self.mqtt_outages = Durations()
+        self.wifi_to_mqtt = Durations()
+        self.disconnect_reasons = Counter()
+        self.mqtt_events = Counter()
+        # GPIO debouncing: (window end, level before the window)
+        self.window = None
+        self.gpio_level = None
+        self.published_level = None
+        self.edges = 0
+        self.edges_offline = 0
+        self.published = 0
+        self.glitches = 0
+
+    def problem(self, r, text):
+        self.problems.append('%12.6f %6d  %s' % (r.time_us / 1e6, r.seq, text))
+
+    def close_window(self, until_us):
+        # The firmware sleeps debounce_ms after an edge and then reads the level
+        if self.window is not None and self.window[0] <= until_us:
+            if self.gpio_level != self.published_level:
+                self.published += 1
+                self.published_level = self.gpio_level
+            elif self.gpio_level == self.window[1]:
+                self.glitches += 1
+            self.window = None
+
+    def on_state(self, r):
+        changed, new = r.arg & 0xffff, r.arg >> 16
+        if self.state is not None:
+            expected = (self.state | changed) if 0 == r.code else (self.state & ~changed)
+            if expected != new:
+                self.problem(r, 'state mismatch: model %s, recorded %s (missing records?)' % (
+                    bits_str(expected), bits_str(new)))
+        self.state = new
+        if 0 == r.code:
+            if changed & MQTT_CONNECTED and not (new & WIFI_CONNECTED):
+                self.problem(r, 'MQTT_CONNECTED set without WIFI_CONNECTED')
+            if changed & NTP_SYNCED and not (new & WIFI_CONNECTED):
+                self.problem(r, 'NTP_SYNCED set without WIFI_CONNECTED')
+            if changed & OTA_DONE and not self.ota_started:
+                self.problem(r, 'OTA_DONE set without OTA start')
+            if changed & WIFI_CONNECTED:
+                self.wifi_up_at = r.time_us
+                if self.wifi_down_since is not None:
+                    self.wifi_outages.add(r.time_us - self.wifi_down_since)
+                    self.wifi_down_since = None
+            if changed & MQTT_CONNECTED:
+                if self.wifi_up_at is not None:
+                    self.wifi_to_mqtt.add(r.time_us - self.wifi_up_at)
+                    self.wifi_up_at = None
+                if self.mqtt_down_since is not None:
+                    self.mqtt_outages.add(r.time_us - self.mqtt_down_since)
+                    self.mqtt_down_since = None
+        else:
+            if changed & WIFI_CONNECTED:
+                self.wifi_down_since = r.time_us
+                self.wifi_up_at = None
+            if changed & MQTT_CONNECTED:
+                self.mqtt_down_since = r.time_us
+            if changed & OTA_DONE:
+                self.ota_started = False
+
+    def feed(self, r):
+        self.close_window(r.time_us)
+        if TRACE_STATE == r.src:
+            self.on_state(r)
+        elif TRACE_WIFI == r.src and WIFI_STA_DISCONNECTED == r.code:
+            self.disconnect_reasons[r.arg] += 1
+        elif TRACE_MQTT == r.src:
+            self.mqtt_events[name(MQTT_EVENTS, r.code)] += 1
+        elif TRACE_OTA == r.src:
+            if 0 == r.code:
+                self.ota_started = True
+        elif TRACE_BOOT == r.src:
+            self.state = 0
+        elif TRACE_GPIO == r.src:
+            self.edges += 1
+            if self.state is not None and not (self.state & MQTT_CONNECTED):
+                self.edges_offline += 1
+            if self.gpio_level is None:
+                # The level before the first recorded edge
+                self.gpio_level = self.published_level = 1 - r.arg
+            if self.window is None:
+                self.window = (r.time_us + self.debounce_us, self.gpio_level)
+            self.gpio_level = r.arg
+
+    def report(self):
+        self.close_window(float('inf'))
+        print('Replay (debounce %.1fms):' % (self.debounce_us / 1e3))
+        print('  WiFi outages:            %s' % self.wifi_outages)
+        print('  WiFi up -> MQTT up:      %s' % self.wifi_to_mqtt)
+        print('  MQTT outages:            %s' % self.mqtt_outages)
+        print('  WiFi disconnect reasons: %s' % (
+            ', '.join('%d:%d' % kv for kv in sorted(self.disconnect_reasons.items())) or '-'))
+        print('  MQTT events:             %s' % (
+            ', '.join('%s:%d' % kv for kv in sorted(self.mqtt_events.items())) or '-'))
+        print('  GPIO edges:              %d (%d while MQTT disconnected)' % (self.edges, self.edges_offline))
+        print('  GPIO transitions:        %d published, %d glitches suppressed' % (self.published, self.glitches))
+        if self.problems:
+            print('Problems:')
+            for p in self.problems:
+                print('  ' + p)
+        return 1 if self.problems else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode and replay esp8266-sensor event traces')
+    parser.add_argument('files', nargs='+', help='Dump files (raw binary or hex lines), - for stdin')
+    parser.add_argument('--replay', action='store_true', help='Replay through the state machine model')
+    parser.add_argument('--debounce-ms', type=float, default=10, help='Debounce time for the replay (default 10)')
+    parser.add_argument('--quiet', action='store_true', help='Do not print the timeline')
+    args = parser.parse_args()
+    try:
+        records, dumps = load(args.files)
+    except (OSError, ValueError) as e:
+        print(e, file=sys.stderr)
+        return 2
+    if not args.quiet:
+        print_timeline(records, dumps)
+    if args.replay:
+        replay = Replay(int(args.debounce_ms * 1000))
+        for r in records:
+            replay.feed(r)
+        return replay.report()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())